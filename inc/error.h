@@ -17,6 +17,7 @@ enum {
 
     E_IPC_NOT_RECV  = 8,    /* Attempt to send to env that is not recving */
     E_EOF           = 9,    /* Unexpected end of file */
+    E_IO            = 10,   /* Disk I/O failed */
 
     MAXERROR
 };
@@ -30,6 +30,7 @@ extern const char *binaryname;
 extern const volatile struct env *thisenv;
 extern const volatile struct env envs[NENV];
 extern const volatile struct page_info pages[];
+extern const volatile struct page_stats pstats;
 
 /* exit.c */
 void    exit(void);
@@ -54,6 +55,10 @@ void *sys_shmem_attach(int key);
 envid_t fork(void);
 void *sys_vma_create(size_t size, int perm, int flags);
 int sys_vma_destroy(void *va, size_t size);
+int sys_vma_advise(void *va, size_t size, int advice);
+int sys_vma_protect(void *va, size_t size, int perm);
+void *sys_disk_map(uint32_t secno, size_t size, int perm);
+int sys_disk_sync(void *va, size_t size);
 
 
 /* File open modes */
@@ -74,4 +79,11 @@ int sys_vma_destroy(void *va, size_t size);
 /* Virtual Memory Area flags */
 #define MAP_POPULATE    0x0001
 
+/* Virtual Memory Area advice */
+#define MADV_NORMAL     0       /* default fault-around */
+#define MADV_RANDOM     1       /* no fault-around */
+#define MADV_SEQUENTIAL 2       /* aggressive fault-around */
+#define MADV_WILLNEED   3       /* map the range now */
+#define MADV_DONTNEED   4       /* drop the pages, keep the range */
+
 #endif  /* !JOS_INC_LIB_H */
@@ -43,12 +43,17 @@
  *                     +------------------------------+                   |
  *                     :              .               :                   |
  *                     :              .               :                   |
- *    MMIOLIM ------>  +------------------------------+ 0xefc00000      --+
+ *                     +------------------------------+                   |
+ *                     |    Per-CPU kmap windows      | RW/--  NCPU*KMAP  |
+ *    MMIOLIM, ----->  +------------------------------+ 0xefc00000      --+
+ *    KMAPBASE
  *                     |       Memory-mapped I/O      | RW/--  PTSIZE
  * ULIM, MMIOBASE -->  +------------------------------+ 0xef800000
  *                     |  Cur. Page Table (User R-)   | R-/R-  PTSIZE
  *    UVPT      ---->  +------------------------------+ 0xef400000
- *                     |          RO PAGES            | R-/R-  PTSIZE
+ *    UPSTATS   ---->  |    RO Page Allocator Stats   | R-/R-  PGSIZE
+ *                     | - - - - - - - - - - - - - - -|
+ *                     |          RO PAGES            | R-/R-  PTSIZE-PGSIZE
  *    UPAGES    ---->  +------------------------------+ 0xef000000
  *                     |           RO ENVS            | R-/R-  PTSIZE
  * UTOP,UENVS ------>  +------------------------------+ 0xeec00000
@@ -97,6 +102,11 @@
 #define KSTKSIZE    (8*PGSIZE)          /* size of a kernel stack */
 #define KSTKGAP     (8*PGSIZE)          /* size of a kernel stack guard */
 
+/* Temporary mappings of high memory, KMAP_SLOTS pages per CPU, at the bottom
+ * of the kernel stack region. */
+#define KMAPBASE    (KSTACKTOP - PTSIZE)
+#define KMAP_SLOTS  8
+
 /* Memory-mapped IO. */
 #define MMIOLIM     (KSTACKTOP - PTSIZE)
 #define MMIOBASE    (MMIOLIM - PTSIZE)
@@ -112,6 +122,8 @@
 #define UVPT        (ULIM - PTSIZE)
 /* Read-only copies of the Page structures */
 #define UPAGES      (UVPT - PTSIZE)
+/* Read-only page allocator statistics, in the last page of the UPAGES window */
+#define UPSTATS     (UVPT - PGSIZE)
 /* Read-only copies of the global env structures */
 #define UENVS       (UPAGES - PTSIZE)
 
@@ -179,6 +191,9 @@ struct page_info {
     /* Next page on the free list. */
     struct page_info *pp_link;
 
+    /* Previous page on the free list, so a buddy can be unlinked in O(1). */
+    struct page_info *pp_prev;
+
     /* pp_ref is the count of pointers (usually in page table entries)
      * to this page, for pages allocated using page_alloc.
      * Pages allocated at boot time using pmap.c's
@@ -186,6 +201,75 @@ struct page_info {
     uint16_t pp_ref;
 
     uint8_t flags;
+
+    /* Buddy order of the block headed by this page: the block spans
+     * (1 << pp_order) pages.  Only meaningful for the first page of a block. */
+    uint8_t pp_order;
+};
+
+/* Largest buddy order. A block of MAX_ORDER is a 4MB huge page. */
+#define MAX_ORDER   10
+
+/* Indices into the per-flag counters of struct page_stats. Index i counts
+ * requests carrying flag (1 << i) of kern/pmap.h's ALLOC_* flags. */
+enum {
+    PSTAT_ZERO,
+    PSTAT_HUGE,
+    PSTAT_PREMAPPED,
+    PSTAT_HIGHMEM,
+    PSTAT_NFLAGS
+};
+
+/*
+ * Physical page allocator statistics, mapped at UPSTATS.
+ * Read/write to the kernel, read-only to user programs.
+ *
+ * The kernel refreshes this page on every timer tick of CPU 0; 'generation'
+ * is incremented by every refresh.
+ */
+struct page_stats {
+    uint32_t generation;
+
+    /* Memory */
+    uint32_t npages;                    /* pages tracked in pages[] */
+    uint32_t npages_high;               /* of which above the direct map */
+    uint32_t nfree;                     /* free pages, including the below */
+    uint32_t nfree_high;                /* free pages above the direct map */
+    uint32_t nfree_cached;              /* free pages in per-CPU caches */
+    uint32_t nfree_zeroed;              /* free pages in the pre-zeroed pool */
+
+    /* Buddy allocator, summed over all zones */
+    uint32_t nr_blocks[MAX_ORDER + 1];  /* free blocks of each order */
+    /* Fragmentation index of each order, in 1/1000: the share of free memory
+     * that sits in blocks too small for a request of that order. 0 means
+     * all free memory can serve the request, 1000 that none can. */
+    uint32_t frag_index[MAX_ORDER + 1];
+
+    /* Requests; frees are attributed to ALLOC_HUGE and ALLOC_HIGHMEM by the
+     * kind of block returned, other flags are not known at free time. */
+    uint32_t allocs;
+    uint32_t frees;
+    uint32_t failures;
+    uint32_t flag_allocs[PSTAT_NFLAGS];
+    uint32_t flag_frees[PSTAT_NFLAGS];
+    uint32_t flag_failures[PSTAT_NFLAGS];
+
+    /* Zeroing */
+    uint32_t zero_pool_hits;            /* ALLOC_ZERO served pre-zeroed */
+    uint32_t zero_pages;                /* pages cleared by page_alloc */
+    uint64_t zero_cycles;               /* TSC cycles spent on that */
+    uint32_t bg_zero_pages;             /* pages cleared by the idle thread */
+    uint64_t bg_zero_cycles;            /* TSC cycles spent on that */
+
+    /* Reclaim */
+    uint32_t reclaim_runs;              /* times page_alloc ran out of memory */
+    uint32_t reclaimed;                 /* pages dropped or swapped out */
+
+    /* Swap */
+    uint32_t swap_slots;                /* page slots on the swap disk */
+    uint32_t swap_used;                 /* of which holding a page */
+    uint32_t swapped_out;               /* anonymous pages written out */
+    uint32_t swapped_in;                /* anonymous pages read back */
 };
 
 #endif /* !__ASSEMBLER__ */
@@ -91,6 +91,7 @@
 #define CR0_PG      0x80000000  /* Paging */
 
 #define CR4_PCE     0x00000100  /* Performance counter enable */
+#define CR4_PGE     0x00000080  /* Page Global Enable */
 #define CR4_MCE     0x00000040  /* Machine Check Enable */
 #define CR4_PSE     0x00000010  /* Page Size Extensions */
 #define CR4_DE      0x00000008  /* Debugging Extensions */
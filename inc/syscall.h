@@ -16,6 +16,10 @@ enum {
     SYS_ipc_send,
     SYS_shmem_alloc,
     SYS_shmem_attach,
+    SYS_vma_advise,
+    SYS_vma_protect,
+    SYS_disk_map,
+    SYS_disk_sync,
     NSYSCALLS
 };
 
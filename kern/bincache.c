@@ -0,0 +1,109 @@
+/*
+ * Page cache for the read-only pages of ELF binaries.
+ */
+
+#include <inc/assert.h>
+#include <inc/mmu.h>
+
+#include <kern/bincache.h>
+#include <kern/kmem.h>
+#include <kern/spinlock.h>
+
+struct bincache_entry {
+    uint8_t *bin;
+    uintptr_t va;
+    struct page_info *pp;
+    struct bincache_entry *next;
+};
+
+static struct bincache_entry *buckets[BINCACHE_BUCKETS];
+static struct kmem_cache *entry_cache;
+
+/* Protects the buckets above */
+static struct spinlock bincache_lock = {
+#ifdef DEBUG_SPINLOCK
+    .name = "bincache_lock"
+#endif
+};
+
+static struct bincache_entry **bucket(uint8_t *bin, uintptr_t va)
+{
+    return &buckets[(((uintptr_t) bin >> PGSHIFT) ^ (va >> PGSHIFT))
+                    % BINCACHE_BUCKETS];
+}
+
+/*
+ * Returns the cached page for address 'va' of image 'bin', or NULL. The
+ * caller maps it, which takes its own reference.
+ */
+struct page_info *bincache_lookup(uint8_t *bin, uintptr_t va)
+{
+    struct page_info *pp = NULL;
+
+    va = ROUNDDOWN(va, PGSIZE);
+    spin_lock(&bincache_lock);
+    for (struct bincache_entry *b = *bucket(bin, va); b; b = b->next) {
+        if (b->bin == bin && b->va == va) {
+            pp = b->pp;
+            break;
+        }
+    }
+    spin_unlock(&bincache_lock);
+    return pp;
+}
+
+/*
+ * Adds page 'pp', freshly read from address 'va' of image 'bin', to the cache.
+ * Caching is best effort: without memory for the entry the page stays private.
+ */
+void bincache_add(uint8_t *bin, uintptr_t va, struct page_info *pp)
+{
+    struct bincache_entry *b;
+
+    if (!entry_cache)
+        entry_cache = kmem_cache_create("bincache", sizeof(struct bincache_entry));
+    if (!(b = kmem_cache_alloc(entry_cache, 0)))
+        return;
+
+    b->bin = bin;
+    b->va = ROUNDDOWN(va, PGSIZE);
+    b->pp = pp;
+
+    spin_lock(&bincache_lock);
+    b->next = *bucket(bin, b->va);
+    *bucket(bin, b->va) = b;
+    pp->pp_ref++;
+    pp->flags |= PAGE_BINCACHE;
+    spin_unlock(&bincache_lock);
+}
+
+/*
+ * Frees up to 'target' cached pages that are no longer mapped by any
+ * environment. Returns the number of pages freed.
+ */
+size_t bincache_shrink(size_t target)
+{
+    size_t freed = 0;
+
+    spin_lock(&bincache_lock);
+    for (size_t i = 0; i < BINCACHE_BUCKETS && freed < target; i++) {
+        struct bincache_entry **link = &buckets[i];
+
+        while (*link && freed < target) {
+            struct bincache_entry *b = *link;
+
+            if (b->pp->pp_ref != 1) {
+                link = &b->next;
+                continue;
+            }
+
+            *link = b->next;
+            b->pp->flags &= ~PAGE_BINCACHE;
+            page_decref(b->pp);
+            kmem_cache_free(entry_cache, b);
+            freed++;
+        }
+    }
+    spin_unlock(&bincache_lock);
+    return freed;
+}
@@ -0,0 +1,26 @@
+#ifndef JOS_KERN_BINCACHE_H
+#define JOS_KERN_BINCACHE_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/pmap.h>
+
+/*
+ * Cache of the read-only pages of ELF binaries.
+ *
+ * Environments created from the same embedded image map its text and rodata
+ * from the same physical pages. A page is keyed by the image and the page's
+ * virtual address, which for a given image determines the segment and offset
+ * it was read from. The cache holds one reference on each page and marks it
+ * PAGE_BINCACHE; page_reclaim releases the pages that no environment maps
+ * any more through bincache_shrink.
+ */
+#define BINCACHE_BUCKETS    256
+
+struct page_info *bincache_lookup(uint8_t *bin, uintptr_t va);
+void bincache_add(uint8_t *bin, uintptr_t va, struct page_info *pp);
+size_t bincache_shrink(size_t target);
+
+#endif /* !JOS_KERN_BINCACHE_H */
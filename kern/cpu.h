@@ -22,6 +22,7 @@ struct cpuinfo {
     uint8_t cpu_id;                /* Local APIC ID; index into cpus[] below */
     volatile unsigned cpu_status;  /* The status of the CPU */
     struct env *cpu_env;           /* The currently-running environment. */
+    pde_t *cpu_pgdir;              /* The page directory loaded in CR3 */
     struct taskstate cpu_ts;       /* Used by x86 to find stack for interrupt */
 };
 
@@ -42,5 +43,6 @@ void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(int cpu, int vector);
 
 #endif
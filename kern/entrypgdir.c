@@ -4,11 +4,12 @@
 pte_t entry_pgtable[NPTENTRIES];
 
 /*
- * The entry.S page directory maps the first 4MB of physical memory
+ * The entry.S page directory maps the first 8MB of physical memory
  * starting at virtual address KERNBASE (that is, it maps virtual
- * addresses [KERNBASE, KERNBASE+4MB) to physical addresses [0, 4MB)).
- * We choose 4MB because that's how much we can map with one page
- * table and it's enough to get us through early boot.  We also map
+ * addresses [KERNBASE, KERNBASE+8MB) to physical addresses [0, 8MB)).
+ * The first 4MB use one page table, the second 4MB a single large page
+ * (entry.S enables CR4_PSE).  The second half holds the 'pages' array
+ * on machines with lots of memory.  We also map
  * virtual addresses [0, 4MB) to physical addresses [0, 4MB); this
  * region is critical for a few instructions in entry.S and then we
  * never use it again.
@@ -26,7 +27,10 @@ pde_t entry_pgdir[NPDENTRIES] = {
         = ((uintptr_t)entry_pgtable - KERNBASE) + PTE_P,
     /* Map VA's [KERNBASE, KERNBASE+4MB) to PA's [0, 4MB). */
     [KERNBASE>>PDXSHIFT]
-        = ((uintptr_t)entry_pgtable - KERNBASE) + PTE_P + PTE_W
+        = ((uintptr_t)entry_pgtable - KERNBASE) + PTE_P + PTE_W,
+    /* Map VA's [KERNBASE+4MB, KERNBASE+8MB) to PA's [4MB, 8MB). */
+    [(KERNBASE>>PDXSHIFT) + 1]
+        = 0x400000 + PTE_P + PTE_W + PTE_PS
 };
 
 /* Entry 0 of the page table maps to physical page 0,
@@ -12,12 +12,31 @@
 #include <kern/trap.h>
 #include <kern/monitor.h>
 #include <kern/vma.h>
+#include <kern/swap.h>
+#include <kern/kernelthread.h>
 
 struct env *envs = NULL;            /* All environments */
 //struct env *curenv = NULL;          /* The current env */
 static struct env *env_free_list;   /* Free environment list */
                                     /* (linked by env->env_link) */
 
+/*
+ * Pool of page directories ready for new environments: the kernel half is a
+ * copy of kern_pgdir, UVPT maps the directory itself and the user half is
+ * empty. env_free returns directories here after clearing their user half,
+ * so creating an environment neither zeroes nor copies a page. The kernel half
+ * is only copied once, so kernel page tables must all exist before env_init.
+ * When memory runs low, directories are freed rather than pooled, and
+ * page_reclaim empties the pool.
+ */
+#define PGDIR_POOL_SIZE     16
+#define PGDIR_POOL_MIN_FREE 256     /* free pages needed to keep pooling */
+
+static pde_t *pgdir_pool[PGDIR_POOL_SIZE];
+static size_t pgdir_pool_len;
+
+static pde_t *pgdir_new(void);
+
 #define ENVGENSHIFT 12      /* >= LOGNENV */
 
 /*
@@ -128,6 +147,14 @@ void env_init(void)
         env_free_list = &envs[inv];
     }
 
+    // pre-build page directories for the first environments
+    while (pgdir_pool_len < PGDIR_POOL_SIZE) {
+        pde_t *pgdir = pgdir_new();
+        if (!pgdir)
+            break;
+        pgdir_pool[pgdir_pool_len++] = pgdir;
+    }
+
     env_init_percpu();
 }
 
@@ -151,10 +178,65 @@ void env_init_percpu(void)
     lldt(0);
 }
 
+/*
+ * Builds a new page directory in the state the pool keeps them in.
+ * Returns NULL if out of memory.
+ */
+static pde_t *pgdir_new(void)
+{
+    struct page_info *p;
+    pde_t *pgdir;
+
+    if (!(p = page_alloc(ALLOC_ZERO)))
+        return NULL;
+
+    /* The VA space of all envs is identical above UTOP, except at UVPT.
+     * The pool holds the reference env_free drops. */
+    p->pp_ref += 1;
+    pgdir = page2kva(p);
+    memcpy(&pgdir[PDX(UTOP)], &kern_pgdir[PDX(UTOP)],
+           (NPDENTRIES - PDX(UTOP)) * sizeof(pde_t));
+
+    /* UVPT maps the env's own page table read-only.
+     * Permissions: kernel R, user R */
+    pgdir[PDX(UVPT)] = PADDR(pgdir) | PTE_P | PTE_U;
+
+    return pgdir;
+}
+
+/*
+ * Returns a page directory whose user half is empty to the pool, or frees it
+ * if the pool is full. Kernel threads run on kern_pgdir, which stays.
+ */
+static void pgdir_put(pde_t *pgdir)
+{
+    if (pgdir == kern_pgdir)
+        return;
+
+    if (pgdir_pool_len < PGDIR_POOL_SIZE
+        && page_free_count() >= PGDIR_POOL_MIN_FREE)
+        pgdir_pool[pgdir_pool_len++] = pgdir;
+    else
+        page_decref(pa2page(PADDR(pgdir)));
+}
+
+/*
+ * Frees up to 'target' page directories of the pool when memory runs out.
+ * Returns the number of pages freed.
+ */
+size_t pgdir_pool_shrink(size_t target)
+{
+    size_t n;
+
+    for (n = 0; n < target && pgdir_pool_len; n++)
+        page_decref(pa2page(PADDR(pgdir_pool[--pgdir_pool_len])));
+    return n;
+}
+
 /*
  * Initialize the kernel virtual memory layout for environment e.
- * Allocate a page directory, set e->env_pgdir accordingly,
- * and initialize the kernel portion of the new environment's address space.
+ * Take a page directory from the pool, or build one if the pool is empty,
+ * and set e->env_pgdir accordingly.
  * Do NOT (yet) map anything into the user portion
  * of the environment's virtual address space.
  *
@@ -163,39 +245,16 @@ void env_init_percpu(void)
  */
 static int env_setup_vm(struct env *e)
 {
-    int i;
-    struct page_info *p = NULL;
-
-    /* Allocate a page for the page directory */
-    if (!(p = page_alloc(ALLOC_ZERO)))
+    if (pgdir_pool_len) {
+        e->env_pgdir = pgdir_pool[--pgdir_pool_len];
+
+        // the kernel half was copied when the directory was built; only
+        // the accessed and dirty bits the MMU sets may differ since
+        for (size_t i = PDX(ULIM); i < NPDENTRIES; i++)
+            assert(((e->env_pgdir[i] ^ kern_pgdir[i]) & ~(PTE_A | PTE_D)) == 0);
+    } else if (!(e->env_pgdir = pgdir_new()))
         return -E_NO_MEM;
 
-    /*
-     * Now, set e->env_pgdir and initialize the page directory.
-     *
-     * Hint:
-     *    - The VA space of all envs is identical above UTOP
-     *  (except at UVPT, which we've set below).
-     *  See inc/memlayout.h for permissions and layout.
-     *  Can you use kern_pgdir as a template?  Hint: Yes.
-     *  (Make sure you got the permissions right in Lab 2.)
-     *    - The initial VA below UTOP is empty.
-     *    - You do not need to make any more calls to page_alloc.
-     *    - Note: In general, pp_ref is not maintained for physical pages mapped
-     *      only above UTOP, but env_pgdir is an exception -- you need to
-     *      increment env_pgdir's pp_ref for env_free to work correctly.
-     *    - The functions in kern/pmap.h are handy.
-     */
-
-    // simply copying the kernel pagedir to environment works fine
-    p->pp_ref += 1;
-    e->env_pgdir = page2kva(p);
-    memcpy(e->env_pgdir, kern_pgdir, PGSIZE);
-
-    /* UVPT maps the env's own page table read-only.
-     * Permissions: kernel R, user R */
-    e->env_pgdir[PDX(UVPT)] = PADDR(e->env_pgdir) | PTE_P | PTE_U;
-
     return 0;
 }
 
@@ -270,51 +329,24 @@ int env_alloc(struct env **newenv_store, envid_t parent_id)
     return 0;
 }
 
-/*
- * Allocate len bytes of physical memory for environment env, and map it at
- * virtual address va in the environment's address space.
- * Does not zero or otherwise initialize the mapped pages in any way.
- * Pages should be writable by user and kernel.
- * Panic if any allocation attempt fails.
- *
- * Hint: It is easier to use region_alloc if the caller can pass
- *   'va' and 'len' values that are not page-aligned.
- *   You should round va down, and round (va + len) up.
- *   (Watch out for corner-cases!)
- */
-void region_alloc(struct env *e, void *va, size_t len)
-{
-    // rounding as decribed above
-    va = ROUNDDOWN(va, PGSIZE);
-    len = (size_t) ROUNDUP(len, PGSIZE);
-
-    // physical page allocation and virtual linking
-    for (size_t i = 0; i < len; i += PGSIZE) {
-        struct page_info *pp = page_alloc(0);
-        if (!pp)
-            panic("region_alloc: could not allocate.\n");
-        page_insert(e->env_pgdir, pp, va + i, PTE_W | PTE_U);
-    }
-}
-
 /*
  * Set up the initial program binary, stack, and processor flags for a user
  * process.
  * This function is ONLY called during kernel initialization, before running the
  * first user-mode environment.
  *
- * This function loads all loadable segments from the ELF binary image into the
- * environment's user memory, starting at the appropriate virtual addresses
- * indicated in the ELF program header.
- * At the same time it clears to zero any portions of these segments that are
- * marked in the program header as being mapped but not actually present in the
- * ELF file - i.e., the program's bss section.
+ * This function sets up a binary VMA for every loadable segment of the ELF
+ * binary image, at the virtual addresses indicated in the ELF program header.
+ * Nothing is copied here: each page is read from the image on its first access
+ * by the page fault handler, which also clears to zero any portions of these
+ * segments that are marked in the program header as being mapped but not
+ * actually present in the ELF file - i.e., the program's bss section.
  *
  * All this is very similar to what our boot loader does, except the boot loader
  * also needs to read the code from disk. Take a look at boot/main.c to get
  * ideas.
  *
- * Finally, this function maps one page for the program's initial stack.
+ * Finally, this function sets up one page for the program's initial stack.
  *
  * load_icode panics if it encounters problems.
  *  - How might load_icode fail?  What might be wrong with the given input?
@@ -338,8 +370,6 @@ static void load_icode(struct env *e, uint8_t *binary)
      *  ELF segments are not necessarily page-aligned, but you can assume for
      *  this function that no two segments will touch the same virtual page.
      *
-     *  You may find a function like region_alloc useful.
-     *
      *  Loading the segments is much simpler if you can move data directly into
      *  the virtual addresses stored in the ELF binary.
      *  So which page directory should be in force during this function?
@@ -359,26 +389,11 @@ static void load_icode(struct env *e, uint8_t *binary)
     ph = (struct elf_proghdr *) ((uint8_t *) p + p->e_phoff);
     eph = ph + p->e_phnum;
 
-    // goto env addressing
-    lcr3(PADDR(e->env_pgdir));
-
-    // copy over the elfblocks
+    // register the segments; their pages are faulted in from the image
     for (; ph < eph; ph++) {
         if (ph->p_type != ELF_PROG_LOAD)
             continue;
 
-        {
-          // [TODO]
-          // the enclosed code is to circumvent a bug with our pagefault
-          // handler (kern/trap.c) which appears to have a bug
-          // the result is that the VMA still maintains an entry for all mem
-          // including BINARY, but will never have to resolve a BINARY page-
-          // fault. The VMA works fine for all ANON memory
-          region_alloc(e, (char *) ph->p_va, ph->p_memsz);
-          if (ph->p_memsz > ph->p_filesz)
-              memset((char *) ph->p_va + ph->p_filesz, 0, ph->p_memsz - ph->p_filesz);
-          memcpy((char *) ph->p_va, binary + ph->p_offset, ph->p_filesz);
-        }
         vma_new(e, (void *) ph->p_va, ph->p_memsz, ph->p_flags, ph, binary);
     }
 
@@ -422,46 +437,42 @@ void env_create(uint8_t *binary, enum env_type type)
  */
 void env_free(struct env *e)
 {
-    pte_t *pt;
-    uint32_t pdeno, pteno;
+    uint32_t pdeno;
     physaddr_t pa;
 
     /* If freeing the current environment, switch to kern_pgdir
      * before freeing the page directory, just in case the page
      * gets reused. */
     if (e == curenv)
-        lcr3(PADDR(kern_pgdir));
+        load_pgdir(kern_pgdir);
 
     /* Note the environment's demise. */
     cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
-    /* Flush all mapped pages in the user portion of the address space */
+    /* Write back what was written to disk regions, then flush all mapped
+     * pages and swap entries in the user portion of the address space. Huge
+     * pages are removed whole, so this cannot fail. */
     static_assert(UTOP % PTSIZE == 0);
-    for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+    if (vma_sync(e, 0, UTOP) < 0)
+        cprintf("[%08x] could not write back disk pages\n", e->env_id);
+    unmap_range(e->env_pgdir, 0, UTOP);
 
-        /* Only look at mapped page tables */
+    /* Free the remaining page tables */
+    for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
         if (!(e->env_pgdir[pdeno] & PTE_P))
             continue;
 
-        /* Find the pa and va of the page table */
         pa = PTE_ADDR(e->env_pgdir[pdeno]);
-        pt = (pte_t*) KADDR(pa);
-
-        /* Unmap all PTEs in this page table */
-        for (pteno = 0; pteno <= PTX(~0); pteno++) {
-            if (pt[pteno] & PTE_P)
-                page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
-        }
-
-        /* Free the page table itself */
         e->env_pgdir[pdeno] = 0;
         page_decref(pa2page(pa));
     }
 
-    /* Free the page directory */
-    pa = PADDR(e->env_pgdir);
+    /* Free the VMA tree */
+    vma_free(e);
+
+    /* Recycle the page directory; its user half is empty now */
+    pgdir_put(e->env_pgdir);
     e->env_pgdir = 0;
-    page_decref(pa2page(pa));
 
     /* return the environment to the free list */
     e->env_status = ENV_FREE;
@@ -533,8 +544,12 @@ void env_run(struct env *e)
         curenv = e;
         curenv->env_status = ENV_RUNNING;
         curenv->env_runs += 1;
-        lcr3(PADDR(curenv->env_pgdir));
+        load_pgdir(curenv->env_pgdir);
     }
 
+    // kernel threads stay in ring 0 and need their own stack restored
+    if (e->env_type == ENV_TYPE_KERNELTHREAD)
+        kernelthread_pop_tf(&e->env_tf);
+
     env_pop_tf(&e->env_tf);
 }
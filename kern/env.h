@@ -14,6 +14,7 @@ void env_init(void);
 void env_init_percpu(void);
 int  env_alloc(struct env **e, envid_t parent_id);
 void env_free(struct env *e);
+size_t pgdir_pool_shrink(size_t target);
 void env_create(uint8_t *binary, enum env_type type);
 void env_destroy(struct env *e); /* Does not return if e == curenv */
 
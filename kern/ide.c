@@ -0,0 +1,161 @@
+/*
+ * Minimal polling PIO driver for the primary and secondary IDE channels.
+ */
+
+#include <inc/x86.h>
+#include <inc/assert.h>
+
+#include <kern/ide.h>
+#include <kern/spinlock.h>
+
+/* Command block registers, relative to the channel's base port */
+#define IDE_DATA        0
+#define IDE_SECTCNT     2
+#define IDE_LBA0        3
+#define IDE_LBA1        4
+#define IDE_LBA2        5
+#define IDE_DRIVE       6
+#define IDE_CMD         7       /* status on read, command on write */
+
+#define IDE_BSY         0x80
+#define IDE_DRDY        0x40
+#define IDE_DF          0x20
+#define IDE_ERR         0x01
+
+#define IDE_CMD_READ    0x20
+#define IDE_CMD_WRITE   0x30
+
+#define IDE_CTRL_NIEN   0x02    /* no interrupts; we poll */
+
+/* Status polls before a disk that never comes ready is given up on */
+#define IDE_WAIT_MAX    1000000
+
+/* A channel has one set of registers, so only one CPU may use it at once */
+static struct ide_channel {
+    uint16_t base;
+    uint16_t ctrl;
+    struct spinlock lock;
+} channels[IDE_NDISKS / 2] = {
+    { .base = 0x1F0, .ctrl = 0x3F6,
+#ifdef DEBUG_SPINLOCK
+      .lock = { .name = "ide_lock0" }
+#endif
+    },
+    { .base = 0x170, .ctrl = 0x376,
+#ifdef DEBUG_SPINLOCK
+      .lock = { .name = "ide_lock1" }
+#endif
+    },
+};
+
+static struct ide_channel *ide_channel(int diskno)
+{
+    assert(diskno >= 0 && diskno < IDE_NDISKS);
+    return &channels[diskno / 2];
+}
+
+/*
+ * Waits until the controller is ready for a command.
+ * Returns -1 if it is not ready after IDE_WAIT_MAX polls, or if 'check_error'
+ * is set and the last command failed.
+ */
+static int ide_wait_ready(struct ide_channel *ch, bool check_error)
+{
+    int r, x;
+
+    for (x = 0; ((r = inb(ch->base + IDE_CMD)) & (IDE_BSY | IDE_DRDY)) != IDE_DRDY; x++)
+        if (x == IDE_WAIT_MAX)
+            return -1;
+
+    if (check_error && (r & (IDE_DF | IDE_ERR)) != 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * Selects 'diskno' and returns whether it answers within a short while.
+ * Also switches the channel to polling, so disk accesses raise no IRQs.
+ */
+bool ide_probe_disk(int diskno)
+{
+    struct ide_channel *ch = ide_channel(diskno);
+    int r, x;
+
+    spin_lock(&ch->lock);
+    outb(ch->ctrl, IDE_CTRL_NIEN);
+    outb(ch->base + IDE_DRIVE, 0xE0 | ((diskno & 1) << 4));
+
+    // a present disk comes ready without errors. An absent one reads back a
+    // status of 0 and never sets DRDY; a channel without disks floats high,
+    // with BSY set.
+    for (x = 0; x < 1000; x++) {
+        r = inb(ch->base + IDE_CMD);
+        if ((r & (IDE_BSY | IDE_DRDY | IDE_DF | IDE_ERR)) == IDE_DRDY)
+            break;
+    }
+    spin_unlock(&ch->lock);
+
+    return x < 1000;
+}
+
+/*
+ * Sends a read or write command for 'nsecs' sectors starting at 'secno'.
+ * Returns -1 if the disk never comes ready for it.
+ */
+static int ide_command(struct ide_channel *ch, int diskno, uint32_t secno,
+                       size_t nsecs, int cmd)
+{
+    assert(nsecs <= 256 && secno < (1 << 28));
+
+    if (ide_wait_ready(ch, 0) < 0)
+        return -1;
+    outb(ch->base + IDE_SECTCNT, nsecs);
+    outb(ch->base + IDE_LBA0, secno & 0xFF);
+    outb(ch->base + IDE_LBA1, (secno >> 8) & 0xFF);
+    outb(ch->base + IDE_LBA2, (secno >> 16) & 0xFF);
+    outb(ch->base + IDE_DRIVE, 0xE0 | ((diskno & 1) << 4) | ((secno >> 24) & 0x0F));
+    outb(ch->base + IDE_CMD, cmd);
+    return 0;
+}
+
+/*
+ * Reads 'nsecs' sectors starting at 'secno' of disk 'diskno' into 'dst'.
+ * Returns 0 on success, -1 on a disk error or if the disk does not answer.
+ */
+int ide_read(int diskno, uint32_t secno, void *dst, size_t nsecs)
+{
+    struct ide_channel *ch = ide_channel(diskno);
+    int r = 0;
+
+    spin_lock(&ch->lock);
+    r = ide_command(ch, diskno, secno, nsecs, IDE_CMD_READ);
+    for (; r == 0 && nsecs > 0; nsecs--, dst += SECTSIZE) {
+        if ((r = ide_wait_ready(ch, 1)) < 0)
+            break;
+        insl(ch->base + IDE_DATA, dst, SECTSIZE / 4);
+    }
+    spin_unlock(&ch->lock);
+
+    return r;
+}
+
+/*
+ * Writes 'nsecs' sectors from 'src' to disk 'diskno' starting at 'secno'.
+ * Returns 0 on success, -1 on a disk error or if the disk does not answer.
+ */
+int ide_write(int diskno, uint32_t secno, const void *src, size_t nsecs)
+{
+    struct ide_channel *ch = ide_channel(diskno);
+    int r = 0;
+
+    spin_lock(&ch->lock);
+    r = ide_command(ch, diskno, secno, nsecs, IDE_CMD_WRITE);
+    for (; r == 0 && nsecs > 0; nsecs--, src += SECTSIZE) {
+        if ((r = ide_wait_ready(ch, 1)) < 0)
+            break;
+        outsl(ch->base + IDE_DATA, src, SECTSIZE / 4);
+    }
+    spin_unlock(&ch->lock);
+
+    return r;
+}
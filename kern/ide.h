@@ -0,0 +1,24 @@
+#ifndef JOS_KERN_IDE_H
+#define JOS_KERN_IDE_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+/*
+ * Polling PIO driver for the disks on the primary and secondary IDE channels.
+ * Disks 0 and 1 are the primary master and slave, disks 2 and 3 the secondary
+ * ones. Disk 0 holds the boot loader and kernel, disk 1 is the swap area and
+ * disk 2 holds data user environments can map (see VMA_DISK in kern/vma.h).
+ */
+#define IDE_NDISKS      4
+#define SECTSIZE        512     /* bytes per disk sector */
+#define SECTPERPAGE     (PGSIZE / SECTSIZE)
+
+bool ide_probe_disk(int diskno);
+int  ide_read(int diskno, uint32_t secno, void *dst, size_t nsecs);
+int  ide_write(int diskno, uint32_t secno, const void *src, size_t nsecs);
+
+#endif /* !JOS_KERN_IDE_H */
@@ -7,6 +7,7 @@
 #include <kern/monitor.h>
 #include <kern/console.h>
 #include <kern/pmap.h>
+#include <kern/kmem.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/trap.h>
@@ -14,6 +15,7 @@
 #include <kern/picirq.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/swap.h>
 
 static void boot_aps(void);
 
@@ -33,6 +35,7 @@ void i386_init(void)
 
     /* Lab 1 and 2 memory management initialization functions. */
     mem_init();
+    kmem_init();
 
     /* Lab 3 user environment initialization functions. */
     env_init();
@@ -45,6 +48,9 @@ void i386_init(void)
     /* Lab 5 multitasking initialization functions */
     pic_init();
 
+    /* Swap area on the second IDE disk, if QEMU was given one */
+    swap_init();
+
 #if defined(TEST)
     /* Don't touch -- used by grading script! */
     ENV_CREATE(TEST, ENV_TYPE_USER);
@@ -59,6 +65,10 @@ void i386_init(void)
     ENV_CREATE(user_yield, ENV_TYPE_USER);
 #endif
 
+    /* Zero freed pages in the background whenever the CPU would idle. Started
+     * after the first environments so their env ids stay predictable. */
+    page_zero_init();
+
     /* Schedule and run the first user environment! */
     sched_yield(false);
 }
@@ -104,7 +114,7 @@ static void boot_aps(void)
 void mp_main(void)
 {
     /* We are in high EIP now, safe to switch to kern_pgdir */
-    lcr3(PADDR(kern_pgdir));
+    load_pgdir(kern_pgdir);
     cprintf("SMP: CPU %d starting\n", cpunum());
 
     lapic_init();
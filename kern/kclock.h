@@ -26,6 +26,10 @@
 /* NVRAM byte 36: current century.  (please increment in Dec99!) */
 #define NVRAM_CENTURY   (MC_NVRAM_START + 36)   /* RTC offset 0x32 */
 
+/* NVRAM bytes 38 & 39: memory above 16MB, in 64K units */
+#define NVRAM_EXT16LO   (MC_NVRAM_START + 38)   /* low byte; RTC off. 0x34 */
+#define NVRAM_EXT16HI   (MC_NVRAM_START + 39)   /* high byte; RTC off. 0x35 */
+
 unsigned mc146818_read(unsigned reg);
 void mc146818_write(unsigned reg, unsigned datum);
 
@@ -6,6 +6,7 @@
 #include <kern/kdebug.h>
 #include <kern/pmap.h>
 #include <kern/env.h>
+#include <kern/uaccess.h>
 
 extern const struct stab __STAB_BEGIN__[];  /* Beginning of stabs table */
 extern const struct stab __STAB_END__[];    /* End of stabs table */
@@ -102,6 +103,25 @@ static void stab_binsearch(const struct stab *stabs, int *region_left,
 }
 
 
+/*
+ * Brings user memory [va, va + len) in, a byte per page through
+ * copy_from_user, so that it can then be read directly. The stabs of a user
+ * binary are paged in on demand like the rest of it.
+ * Returns -1 if any of it may not be read.
+ */
+static int user_fault_in(const void *va, size_t len)
+{
+    uintptr_t a = (uintptr_t) va, end = a + len;
+    char c;
+
+    if (end < a)
+        return -1;
+    for (; a < end; a = ROUNDDOWN(a, PGSIZE) + PGSIZE)
+        if (copy_from_user(&c, (const void *) a, 1))
+            return -1;
+    return 0;
+}
+
 /* debuginfo_eip(addr, info)
  *
  *  Fill in the 'info' structure with information about the specified
@@ -137,29 +157,30 @@ int debuginfo_eip(uintptr_t addr, struct eip_debuginfo *info)
          * __STABSTR_END__) in a structure located at virtual address
          * USTABDATA.
          */
-        const struct user_stab_data *usd =
-            (const struct user_stab_data *)USTABDATA;
+        struct user_stab_data usd;
 
         /*
          * Make sure this memory is valid.
-         * Return -1 if it is not.  Hint: Call user_mem_check.
+         * Return -1 if it is not. It is paged in on demand, so it is read
+         * with copy_from_user rather than checked with user_mem_check.
          */
-	if (user_mem_check(curenv, usd, sizeof(struct user_stab_data), PTE_U))
+        if (!curenv || curenv->env_type == ENV_TYPE_KERNELTHREAD
+            || copy_from_user(&usd, (const void *) USTABDATA,
+                              sizeof(struct user_stab_data)))
             return -1;
 
-        stabs = usd->stabs;
-        stab_end = usd->stab_end;
-        stabstr = usd->stabstr;
-        stabstr_end = usd->stabstr_end;
+        stabs = usd.stabs;
+        stab_end = usd.stab_end;
+        stabstr = usd.stabstr;
+        stabstr_end = usd.stabstr_end;
 
         /*
-         * Make sure the STABS and string table memory are valid.
+         * Make sure the STABS and string table memory are valid, and
+         * present for the direct reads below.
          */
-	if (user_mem_check(curenv, stabs,
-                    (uintptr_t)stab_end - (uintptr_t)stabs, PTE_U))
+        if (user_fault_in(stabs, (uintptr_t)stab_end - (uintptr_t)stabs))
             return -1;
-        if (user_mem_check(curenv, stabs,
-                    (uintptr_t)stabstr_end - (uintptr_t)stabstr, PTE_U))
+        if (user_fault_in(stabstr, (uintptr_t)stabstr_end - (uintptr_t)stabstr))
             return -1;
     }
 
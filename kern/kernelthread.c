@@ -24,11 +24,15 @@
 #include <kern/kernelthread.h>
 
 /**
- * Spawns a new kernel thread. This function is very similar to env_create, but
- * it does not load in some icode and it does not prepare the dummy VMAs for
- * lab4. It also sets the structure different (disable interupts, etc...)
+ * Spawns a new kernel thread that starts executing 'fn' on its own one-page
+ * kernel stack. This function is very similar to env_create, but it does not
+ * load in some icode and it does not prepare the dummy VMAs for lab4. It also
+ * sets the structure different (disable interupts, etc...)
+ *
+ * 'fn' must never return; a thread gives up the CPU with kernelthread_yield()
+ * or kernelthread_sleep().
  */
-void kernelthread_create() {
+struct env *kernelthread_create(void (*fn)(void)) {
     // allocate environment
     struct env *e;
     if (env_alloc(&e, 0) < 0)
@@ -42,6 +46,7 @@ void kernelthread_create() {
     // generate kernel stack
     struct page_info *pp = page_alloc(ALLOC_ZERO);
     if (!pp) panic("page_alloc");
+    pp->pp_ref += 1;
 
     // set values
     e->env_tf.tf_ds = GD_KD;
@@ -49,66 +54,109 @@ void kernelthread_create() {
     e->env_tf.tf_cs = GD_KT;
     e->env_tf.tf_ss = GD_KD;
     e->env_tf.tf_esp = (size_t) (page2kva(pp) + PGSIZE);
-    void (*sp) (void) = &spinner;   // TODO temp code: get the function pointer to spinner
-    e->env_tf.tf_eip = (size_t) sp; // TODO: Point to C-function this kernel thread will do
+    e->env_tf.tf_eip = (size_t) fn;
     e->env_tf.tf_eflags &= ~FL_IF;  // disable interupts
 
     // set environment type
     e->env_type = ENV_TYPE_KERNELTHREAD;
     e->env_pgdir = kern_pgdir;
+
+    return e;
 }
 
 /**
- * Forces the kernelthread to yield.
+ * Saves the callee-saved registers, stack and a resume address of the current
+ * kernel thread in its trapframe, sets its status and enters the scheduler.
+ * When the thread is picked again, kernelthread_pop_tf() resumes it right
+ * after the call to sched_yield, so this function returns normally.
  */
-void kernelthread_yield() {
-    void *addr = __builtin_return_address(0);
-
-    cprintf("\033[0;31m kernel thread yielding \033[0m\n");
+static void kernelthread_switch(unsigned status) {
+    struct trapframe *tf = &curenv->env_tf;
 
     if (curenv->env_type != ENV_TYPE_KERNELTHREAD)
         panic("Called kernelthread_yield, but curenv is not a kernel thread.");
 
-    curenv->env_status = ENV_RUNNABLE;
+    curenv->env_status = status;
 
-    // push our own trapframe
-    // reverse order of appearance in trap.h
     __asm __volatile(
-        "pushl %%ss\n"      // ss
-        "pushl %%esp\n"     // esp
-        "pushfl\n"          // eflags
-        "pushl %%cs\n"      // cs
-        "pushl %0\n"        // eip -- __builtin_return_address
-        "pushl $0\n"        // err
-        "pushl $0\n"        // trapno
-        "pushl %%ds\n"      // ds
-        "pushl %%es\n"      // es
-        "pushal\n"          // registers
-        : : "m" (addr) : "memory"
+        "movl %%ebx, %c[ebx](%0)\n"
+        "movl %%esi, %c[esi](%0)\n"
+        "movl %%edi, %c[edi](%0)\n"
+        "movl %%ebp, %c[ebp](%0)\n"
+        "movl %%esp, %c[esp](%0)\n"
+        "movl $1f, %c[eip](%0)\n"
+        "pushfl\n"
+        "popl %c[eflags](%0)\n"
+        "pushl $1\n"                // sched_yield(true), never returns
+        "call sched_yield\n"
+        "1:\n"
+        : : "r" (tf),
+            [ebx] "i" (offsetof(struct trapframe, tf_regs.reg_ebx)),
+            [esi] "i" (offsetof(struct trapframe, tf_regs.reg_esi)),
+            [edi] "i" (offsetof(struct trapframe, tf_regs.reg_edi)),
+            [ebp] "i" (offsetof(struct trapframe, tf_regs.reg_ebp)),
+            [esp] "i" (offsetof(struct trapframe, tf_esp)),
+            [eip] "i" (offsetof(struct trapframe, tf_eip)),
+            [eflags] "i" (offsetof(struct trapframe, tf_eflags))
+        : "eax", "ecx", "edx", "memory", "cc"
     );
+}
 
-    // goto normal scheduler
-    cprintf("\033[0;31m now going to sched_yield(true) \033[0m\n");
-    sched_yield(true);
+/**
+ * Forces the kernelthread to yield. It stays runnable.
+ */
+void kernelthread_yield() {
+    kernelthread_switch(ENV_RUNNABLE);
 }
 
 /**
- * If detecting a swap from ENV_TYPE_USER to ENV_TYPE_KERNELTHREAD, run a
- * special pop_tf function to respect the changes to iret's functioning
+ * Puts the kernelthread to sleep until kernelthread_wakeup() is called on it.
+ */
+void kernelthread_sleep() {
+    kernelthread_switch(ENV_NOT_RUNNABLE);
+}
+
+/**
+ * Makes a sleeping kernelthread runnable again.
+ */
+void kernelthread_wakeup(struct env *e) {
+    if (e->env_status == ENV_NOT_RUNNABLE)
+        e->env_status = ENV_RUNNABLE;
+}
+
+/**
+ * Kernel threads run in ring 0, so iret does not restore esp. Switch to the
+ * thread's own stack first and build the iret frame there.
  */
 void kernelthread_pop_tf(struct trapframe *tf)
 {
-    cprintf("\033[0;31m kern pop tf \033[0m\n");
-
     __asm __volatile(
-        "movl %0,%%esp\n"
-        "popal\n"
-        "popl %%es\n"
-        "popl %%ds\n"
-        "addl $0x10,%%esp\n"  // <- Fixed the alignment issue mentioned in mail
-        "popl %%esp\n"        // <- Tried to pop ESP but it doesnt work
+        "movl %0, %%eax\n"
+        "movl %c[esp](%%eax), %%esp\n"
+        "pushl %c[eflags](%%eax)\n"
+        "pushl %c[cs](%%eax)\n"
+        "pushl %c[eip](%%eax)\n"
+        "movl %c[edi](%%eax), %%edi\n"
+        "movl %c[esi](%%eax), %%esi\n"
+        "movl %c[ebp](%%eax), %%ebp\n"
+        "movl %c[ebx](%%eax), %%ebx\n"
+        "movl %c[edx](%%eax), %%edx\n"
+        "movl %c[ecx](%%eax), %%ecx\n"
+        "movl %c[eax](%%eax), %%eax\n"
         "iret"
-        : : "g" (tf) : "memory"
+        : : "g" (tf),
+            [edi] "i" (offsetof(struct trapframe, tf_regs.reg_edi)),
+            [esi] "i" (offsetof(struct trapframe, tf_regs.reg_esi)),
+            [ebp] "i" (offsetof(struct trapframe, tf_regs.reg_ebp)),
+            [ebx] "i" (offsetof(struct trapframe, tf_regs.reg_ebx)),
+            [edx] "i" (offsetof(struct trapframe, tf_regs.reg_edx)),
+            [ecx] "i" (offsetof(struct trapframe, tf_regs.reg_ecx)),
+            [eax] "i" (offsetof(struct trapframe, tf_regs.reg_eax)),
+            [eip] "i" (offsetof(struct trapframe, tf_eip)),
+            [cs] "i" (offsetof(struct trapframe, tf_cs)),
+            [eflags] "i" (offsetof(struct trapframe, tf_eflags)),
+            [esp] "i" (offsetof(struct trapframe, tf_esp))
+        : "memory"
     );
 
     panic("iret failed");  /* mostly to placate the compiler */
@@ -3,9 +3,13 @@
 
 #include <kern/trap.h>
 
-void kernelthread_create();
+struct env;
+
+struct env *kernelthread_create(void (*fn)(void));
 void kernelthread_yield();
-void kernelthread_pop_tf(struct trapframe *tf);
+void kernelthread_sleep();
+void kernelthread_wakeup(struct env *e);
+void kernelthread_pop_tf(struct trapframe *tf) __attribute__((noreturn));
 void spinner();
 
 #endif // JOS_KERN_KT_H
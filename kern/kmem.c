@@ -0,0 +1,258 @@
+/*
+ * Slab allocator for small kernel objects, built on top of page_alloc.
+ * See kern/kmem.h for an overview.
+ */
+
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/kmem.h>
+#include <kern/pmap.h>
+
+/* Header at the start of every slab page. */
+struct slab {
+    struct kmem_cache *cache;   /* cache this slab belongs to */
+    struct slab *next;          /* on cache->partial or cache->full */
+    struct slab *prev;
+    void *free;                 /* free objects, linked through their first word */
+    size_t inuse;               /* objects handed out (incl. CPU caches) */
+};
+
+#define SLAB_HDR_SIZE   ROUNDUP(sizeof(struct slab), KMEM_ALIGN)
+
+/* The cache that kmem_cache descriptors themselves are allocated from. */
+static struct kmem_cache cache_cache;
+
+/* All caches, for kmem_print. */
+static struct kmem_cache *cache_list;
+
+/*
+ * Helpers to maintain the doubly linked slab lists of a cache.
+ */
+static void slab_list_add(struct slab **list, struct slab *s)
+{
+    s->prev = NULL;
+    s->next = *list;
+    if (*list)
+        (*list)->prev = s;
+    *list = s;
+}
+
+static void slab_list_remove(struct slab **list, struct slab *s)
+{
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        *list = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    s->next = s->prev = NULL;
+}
+
+/*
+ * Allocates a page for a new slab and threads all its objects onto the
+ * slab's free list. Returns NULL if out of memory.
+ */
+static struct slab *slab_new(struct kmem_cache *cache)
+{
+    struct page_info *pp = page_alloc(0);
+    if (!pp)
+        return NULL;
+    pp->pp_ref += 1;
+
+    struct slab *s = page2kva(pp);
+    s->cache = cache;
+    s->next = s->prev = NULL;
+    s->inuse = 0;
+    s->free = NULL;
+
+    // link objects back to front so the first object is handed out first
+    char *base = (char *) s + SLAB_HDR_SIZE;
+    for (size_t i = cache->per_slab; i-- > 0; ) {
+        void **obj = (void **) (base + i * cache->size);
+        *obj = s->free;
+        s->free = obj;
+    }
+
+    cache->nr_slabs += 1;
+    return s;
+}
+
+/*
+ * Returns an empty slab's page to the page allocator.
+ */
+static void slab_destroy(struct kmem_cache *cache, struct slab *s)
+{
+    cache->nr_slabs -= 1;
+    page_decref(pa2page(PADDR(s)));
+}
+
+/*
+ * Moves up to KMEM_CPU_BATCH objects from the slabs into a CPU cache.
+ */
+static void kmem_refill(struct kmem_cache *cache, struct kmem_cpu_cache *cc)
+{
+    spin_lock(&cache->lock);
+    while (cc->count < KMEM_CPU_BATCH) {
+        struct slab *s = cache->partial;
+
+        // grow the cache by one slab
+        if (!s) {
+            if (!(s = slab_new(cache)))
+                break;
+            slab_list_add(&cache->partial, s);
+        }
+
+        void **obj = s->free;
+        s->free = *obj;
+        s->inuse += 1;
+
+        if (s->inuse == cache->per_slab) {
+            slab_list_remove(&cache->partial, s);
+            slab_list_add(&cache->full, s);
+        }
+
+        cc->objs[cc->count++] = obj;
+    }
+    spin_unlock(&cache->lock);
+}
+
+/*
+ * Gives the 'n' coldest objects (bottom of the stack) of a CPU cache back to
+ * their slabs. Slabs that become empty are released.
+ */
+static void kmem_drain(struct kmem_cache *cache, struct kmem_cpu_cache *cc,
+                       size_t n)
+{
+    if (n > cc->count)
+        n = cc->count;
+
+    spin_lock(&cache->lock);
+    for (size_t i = 0; i < n; i++) {
+        void **obj = cc->objs[i];
+        struct slab *s = ROUNDDOWN((void *) obj, PGSIZE);
+
+        assert(s->cache == cache);
+
+        if (s->inuse == cache->per_slab) {
+            slab_list_remove(&cache->full, s);
+            slab_list_add(&cache->partial, s);
+        }
+
+        *obj = s->free;
+        s->free = obj;
+        s->inuse -= 1;
+
+        if (s->inuse == 0) {
+            slab_list_remove(&cache->partial, s);
+            slab_destroy(cache, s);
+        }
+    }
+    spin_unlock(&cache->lock);
+
+    memmove(&cc->objs[0], &cc->objs[n], (cc->count - n) * sizeof(cc->objs[0]));
+    cc->count -= n;
+}
+
+/*
+ * Fills in a cache descriptor for objects of 'size' bytes.
+ */
+static void kmem_cache_setup(struct kmem_cache *cache, const char *name,
+                             size_t size)
+{
+    memset(cache, 0, sizeof(*cache));
+    strncpy(cache->name, name, KMEM_NAME_LEN - 1);
+
+    // objects must at least hold the free list link
+    if (size < sizeof(void *))
+        size = sizeof(void *);
+    cache->size = ROUNDUP(size, KMEM_ALIGN);
+    if (cache->size > PGSIZE - SLAB_HDR_SIZE)
+        panic("kmem_cache_create: %s objects of %u bytes do not fit a slab",
+              name, size);
+    cache->per_slab = (PGSIZE - SLAB_HDR_SIZE) / cache->size;
+
+    __spin_initlock(&cache->lock, cache->name);
+
+    cache->next = cache_list;
+    cache_list = cache;
+}
+
+/*
+ * Sets up the cache for kmem_cache descriptors. Must be called after
+ * mem_init and before the first kmem_cache_create.
+ */
+void kmem_init(void)
+{
+    kmem_cache_setup(&cache_cache, "kmem_cache", sizeof(struct kmem_cache));
+}
+
+/*
+ * Creates a cache for objects of 'size' bytes.
+ * Panics on failure.
+ */
+struct kmem_cache *kmem_cache_create(const char *name, size_t size)
+{
+    assert(cache_cache.size);
+
+    struct kmem_cache *cache = kmem_cache_alloc(&cache_cache, 0);
+    if (!cache)
+        panic("kmem_cache_create: out of memory for cache %s", name);
+
+    kmem_cache_setup(cache, name, size);
+    return cache;
+}
+
+/*
+ * Allocates one object from 'cache'. ALLOC_ZERO clears the object.
+ * Returns NULL if out of memory.
+ */
+void *kmem_cache_alloc(struct kmem_cache *cache, int alloc_flags)
+{
+    struct kmem_cpu_cache *cc = &cache->cpu[cpunum()];
+
+    if (!cc->count)
+        kmem_refill(cache, cc);
+
+    // no free memory
+    if (!cc->count)
+        return NULL;
+
+    void *obj = cc->objs[--cc->count];
+    cache->allocs += 1;
+
+    if (alloc_flags & ALLOC_ZERO)
+        memset(obj, 0, cache->size);
+
+    return obj;
+}
+
+/*
+ * Returns an object to 'cache'.
+ */
+void kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+    struct kmem_cpu_cache *cc = &cache->cpu[cpunum()];
+
+    if (!obj)
+        return;
+
+    if (cc->count == KMEM_CPU_HIGH)
+        kmem_drain(cache, cc, KMEM_CPU_BATCH);
+
+    cc->objs[cc->count++] = obj;
+    cache->frees += 1;
+}
+
+/*
+ * Debug function. Prints the state of all caches.
+ */
+void kmem_print(void)
+{
+    cprintf("cache            objsize  per-slab  slabs  in-use   allocs    frees\n");
+    for (struct kmem_cache *c = cache_list; c; c = c->next) {
+        cprintf("%-16s %7u  %8u  %5u  %6u  %7u  %7u\n", c->name, c->size,
+                c->per_slab, c->nr_slabs, c->allocs - c->frees,
+                c->allocs, c->frees);
+    }
+}
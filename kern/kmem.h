@@ -0,0 +1,57 @@
+#ifndef JOS_KERN_KMEM_H
+#define JOS_KERN_KMEM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+/*
+ * Slab allocator for kernel objects smaller than a page.
+ *
+ * Each cache hands out objects of one fixed size. Objects are carved out of
+ * slabs, single pages from page_alloc with a struct slab header at the start
+ * of the page, so kmem_cache_free finds the slab of an object by rounding its
+ * address down to the page. Every CPU keeps a small stack of free objects per
+ * cache, refilled from and drained to the slabs in batches of KMEM_CPU_BATCH.
+ */
+#define KMEM_NAME_LEN   16
+#define KMEM_CPU_HIGH   16      /* max objects held in one CPU's cache */
+#define KMEM_CPU_BATCH  8       /* objects moved per refill or drain */
+#define KMEM_ALIGN      8       /* minimum object alignment */
+
+struct slab;
+
+struct kmem_cpu_cache {
+    void *objs[KMEM_CPU_HIGH];  /* LIFO stack, hottest object on top */
+    size_t count;
+};
+
+struct kmem_cache {
+    char name[KMEM_NAME_LEN];
+    size_t size;                /* object size, rounded up to KMEM_ALIGN */
+    size_t per_slab;            /* objects that fit in one slab */
+
+    struct spinlock lock;       /* protects the slab lists below */
+    struct slab *partial;       /* slabs with some objects in use */
+    struct slab *full;          /* slabs with every object in use */
+    size_t nr_slabs;
+
+    struct kmem_cpu_cache cpu[NCPU];
+
+    /* statistics */
+    uint32_t allocs;
+    uint32_t frees;
+
+    struct kmem_cache *next;    /* list of all caches */
+};
+
+void kmem_init(void);
+struct kmem_cache *kmem_cache_create(const char *name, size_t size);
+void *kmem_cache_alloc(struct kmem_cache *cache, int alloc_flags);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+void kmem_print(void);
+
+#endif /* !JOS_KERN_KMEM_H */
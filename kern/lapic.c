@@ -181,3 +181,12 @@ void lapic_ipi(int vector)
     while (lapic[ICRLO] & DELIVS)
         ;
 }
+
+/* Send an IPI to the single CPU cpus[cpu]. */
+void lapic_ipi_cpu(int cpu, int vector)
+{
+    lapicw(ICRHI, cpus[cpu].cpu_id << 24);
+    lapicw(ICRLO, FIXED | vector);
+    while (lapic[ICRLO] & DELIVS)
+        ;
+}
@@ -14,6 +14,9 @@
 #include <kern/kdebug.h>
 #include <kern/trap.h>
 #include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/kmem.h>
 
 #define CMDBUF_SIZE 80  /* enough for one VGA text line */
 
@@ -29,6 +32,9 @@ static struct command commands[] = {
     { "help", "Display this list of commands", mon_help },
     { "kerninfo", "Display information about the kernel", mon_kerninfo },
     { "backtrace", "Display stack backtrace", mon_backtrace },
+    { "pagecache", "Display per-CPU page cache statistics", mon_pagecache },
+    { "slabinfo", "Display kernel object cache statistics", mon_slabinfo },
+    { "pagestats", "Display physical page allocator statistics", mon_pagestats },
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -90,6 +96,69 @@ int mon_backtrace(int argc, char **argv, struct trapframe *tf)
     return 0;
 }
 
+int mon_pagecache(int argc, char **argv, struct trapframe *tf)
+{
+    static const char * const zone_names[NZONES] = { "normal", "high" };
+    int i, zone;
+
+    cprintf("CPU  zone    cached   allocs   hit%%     frees  refills   drains\n");
+    for (i = 0; i < ncpu; i++) {
+        for (zone = 0; zone < NZONES; zone++) {
+            struct page_cache *pc = &page_caches[i][zone];
+            uint32_t allocs = pc->alloc_hits + pc->alloc_misses;
+
+            cprintf("%3d  %-6s  %6u  %7u  %4u%%  %7u  %7u  %7u\n", i,
+                    zone_names[zone], pc->count,
+                    allocs, allocs ? pc->alloc_hits * 100 / allocs : 0,
+                    pc->free_hits, pc->refills, pc->drains);
+        }
+    }
+    return 0;
+}
+
+int mon_slabinfo(int argc, char **argv, struct trapframe *tf)
+{
+    kmem_print();
+    return 0;
+}
+
+int mon_pagestats(int argc, char **argv, struct trapframe *tf)
+{
+    static const char * const flag_names[PSTAT_NFLAGS] = {
+        "zero", "huge", "premapped", "highmem"
+    };
+    struct page_stats *st = page_stats;
+    int i;
+
+    page_stats_update();
+
+    cprintf("Memory: %u pages, %u high\n", st->npages, st->npages_high);
+    cprintf("Free:   %u pages, %u high, %u cached, %u zeroed\n", st->nfree,
+            st->nfree_high, st->nfree_cached, st->nfree_zeroed);
+
+    cprintf("order   blocks     pages   frag\n");
+    for (i = 0; i <= MAX_ORDER; i++)
+        cprintf("%5d  %7u  %8u  %3u.%u%%\n", i, st->nr_blocks[i],
+                st->nr_blocks[i] << i, st->frag_index[i] / 10,
+                st->frag_index[i] % 10);
+
+    cprintf("flag          allocs     frees  failures\n");
+    cprintf("%-10s  %8u  %8u  %8u\n", "all", st->allocs, st->frees,
+            st->failures);
+    for (i = 0; i < PSTAT_NFLAGS; i++)
+        cprintf("%-10s  %8u  %8u  %8u\n", flag_names[i], st->flag_allocs[i],
+                st->flag_frees[i], st->flag_failures[i]);
+
+    cprintf("Zeroing: %u pool hits, %u pages in page_alloc (%llu cycles), "
+            "%u pages in background (%llu cycles)\n", st->zero_pool_hits,
+            st->zero_pages, st->zero_cycles, st->bg_zero_pages,
+            st->bg_zero_cycles);
+    cprintf("Reclaim: %u runs, %u pages\n", st->reclaim_runs, st->reclaimed);
+    cprintf("Swap: %u of %u slots used, %u pages out, %u pages in\n",
+            st->swap_used, st->swap_slots, st->swapped_out, st->swapped_in);
+    return 0;
+}
+
 /***** Kernel monitor command interpreter *****/
 
 #define WHITESPACE "\t\r\n "
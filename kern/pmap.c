@@ -11,15 +11,64 @@
 #include <kern/pmap.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
+#include <kern/spinlock.h>
+#include <kern/sched.h>
+#include <kern/kernelthread.h>
+#include <kern/reclaim.h>
+#include <kern/swap.h>
 
 /* These variables are set by i386_detect_memory() */
 size_t npages;                  /* Amount of physical memory (in pages) */
+size_t npages_lowmem;           /* Pages direct-mapped at KERNBASE */
 static size_t npages_basemem;   /* Amount of base memory (in pages) */
 
+/* Pages that can be direct-mapped at KERNBASE */
+#define LOWMEM_PAGES    ((0xffffffff - KERNBASE + 1) / PGSIZE)
+
+/* The 'pages' array must fit both the UPAGES window below UPSTATS and the 8MB
+ * that entry_pgdir maps for boot_alloc, so memory beyond this is ignored. */
+#define MAX_PAGES       ((PTSIZE - PGSIZE) / sizeof(struct page_info) \
+                         / NPTENTRIES * NPTENTRIES)
+
 /* These variables are set in mem_init() */
 pde_t *kern_pgdir;                       /* Kernel's initial page directory */
 struct page_info *pages;                 /* Physical page state array */
-static struct page_info *page_free_list; /* Free list of physical pages */
+struct page_stats *page_stats;           /* Allocator statistics at UPSTATS */
+
+/* Buddy allocator: one free list of blocks per zone and order. A block of
+ * order k spans (1 << k) physically contiguous pages and starts at a page
+ * index that is a multiple of (1 << k). Lists are doubly linked through
+ * pp_link and pp_prev so a buddy can be taken off its list during coalescing
+ * in O(1). */
+struct free_area {
+    struct page_info *free_list;
+    size_t nr_free;                      /* Number of blocks on free_list */
+};
+static struct free_area free_area[NZONES][MAX_ORDER + 1];
+
+/* Protects free_area. The per-CPU caches are only touched by their own CPU
+ * and need no lock. */
+static struct spinlock page_lock = {
+#ifdef DEBUG_SPINLOCK
+    .name = "page_lock"
+#endif
+};
+
+/* Per-CPU order-0 page caches, one per zone */
+struct page_cache page_caches[NCPU][NZONES];
+
+/* Nesting depth of kmap on each CPU; slot i of a CPU is in use iff i < depth */
+static size_t kmap_depth[NCPU];
+static pte_t *kmap_ptes;                /* PTEs backing [KMAPBASE, +KMAPSIZE) */
+
+/* Allocator counters, kept per CPU so that the cache fast paths need no lock.
+ * Only the counter fields are used; page_stats_update sums them up. */
+static struct page_stats cpu_stats[NCPU];
+
+/* Pre-zeroed pages, linked through pp_link. Protected by page_lock. */
+static struct page_info *zero_list;
+static size_t nr_zero;
+static struct env *zero_thread;         /* Kernel thread filling zero_list */
 
 
 /***************************************************************
@@ -33,12 +82,20 @@ static int nvram_read(int r)
 
 static void i386_detect_memory(void)
 {
-    size_t npages_extmem;
+    size_t npages_extmem, npages_ext16mem;
 
     /* Use CMOS calls to measure available base & extended memory.
-     * (CMOS calls return results in kilobytes.) */
+     * (CMOS calls return results in kilobytes, except for the memory above
+     * 16MB which is counted in 64K units.) */
     npages_basemem = (nvram_read(NVRAM_BASELO) * 1024) / PGSIZE;
     npages_extmem = (nvram_read(NVRAM_EXTLO) * 1024) / PGSIZE;
+    npages_ext16mem = (nvram_read(NVRAM_EXT16LO) * 64 * 1024) / PGSIZE;
+
+    /* The extended memory register saturates at 64MB, so prefer the count
+     * above 16MB when there is one. */
+    if (npages_ext16mem)
+        npages_extmem = (16 * 1024 * 1024 - EXTPHYSMEM) / PGSIZE
+                        + npages_ext16mem;
 
     /* Calculate the number of physical pages available in both base and
      * extended memory. */
@@ -51,6 +108,17 @@ static void i386_detect_memory(void)
         npages * PGSIZE / 1024,
         npages_basemem * PGSIZE / 1024,
         npages_extmem * PGSIZE / 1024);
+
+    if (npages > MAX_PAGES) {
+        cprintf("Physical memory: ignoring %uK above %uK\n",
+            (npages - MAX_PAGES) * PGSIZE / 1024, MAX_PAGES * PGSIZE / 1024);
+        npages = MAX_PAGES;
+    }
+
+    npages_lowmem = MIN(npages, LOWMEM_PAGES);
+    if (npages > npages_lowmem)
+        cprintf("Physical memory: %uK high memory\n",
+            (npages - npages_lowmem) * PGSIZE / 1024);
 }
 
 
@@ -66,6 +134,8 @@ static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 static void check_page(void);
 static void check_page_installed_pgdir(void);
 static void check_page_hugepages(void);
+static void check_pt_share(void);
+static size_t count_free_pages(void);
 
 /* This simple physical memory allocator is used only while JOS is setting up
  * its virtual memory system.  page_alloc() is the real allocator.
@@ -78,7 +148,7 @@ static void check_page_hugepages(void);
  *
  * If we're out of memory, boot_alloc should panic.
  * This function may ONLY be used during initialization, before the
- * page_free_list list has been set up.
+ * buddy free lists have been set up.
  */
 static void *boot_alloc(uint32_t n)
 {
@@ -97,12 +167,12 @@ static void *boot_alloc(uint32_t n)
     result = nextfree;
 
     // update nextfree and align it to page size
-    // the limit here is 4MB becase entrypgdir.c doesn't map higher
+    // the limit here is 8MB becase entrypgdir.c doesn't map higher
     // see also reference [1] on slides 02
     if (n > 0) {
         nextfree = ROUNDUP(nextfree + n, PGSIZE);
-        if (nextfree > (char *) 0xf0400000)
-            panic("boot_alloc: attempted to allocate over the 4MB mark.");
+        if (nextfree > (char *) 0xf0800000)
+            panic("boot_alloc: attempted to allocate over the 8MB mark.");
     }
 
     return result;
@@ -169,6 +239,10 @@ void mem_init(void)
     // LAB3: set up envs array
     envs = boot_alloc(NENV * sizeof(struct env));
 
+    // allocator statistics page, exported at UPSTATS
+    page_stats = boot_alloc(PGSIZE);
+    memset(page_stats, 0, PGSIZE);
+
     /*********************************************************************
      * Now that we've allocated the initial kernel data structures, we set
      * up the list of free physical pages. Once we've done so, all further
@@ -192,7 +266,13 @@ void mem_init(void)
      *    - pages itself -- kernel RW, user NONE
      * Your code goes here:
      */
-    boot_map_region(kern_pgdir, UPAGES, PTSIZE, PADDR(pages), PTE_U | PTE_P);
+    boot_map_region(kern_pgdir, UPAGES,
+            ROUNDUP(sizeof(struct page_info) * npages, PGSIZE),
+            PADDR(pages), PTE_U | PTE_P);
+
+    /* The allocator statistics share the UPAGES window; MAX_PAGES keeps
+     * 'pages' clear of its last page. */
+    boot_map_region(kern_pgdir, UPSTATS, PGSIZE, PADDR(page_stats), PTE_U);
 
     /* This is set up already by the identity mapping below. */
     boot_map_region(kern_pgdir, UPAGES,
@@ -246,6 +326,23 @@ void mem_init(void)
      * leaving this as guard region.
      */
 
+    /*********************************************************************
+     * The bottom of the kernel stack region holds the kmap windows. Their
+     * page table is shared with the kernel stacks and created here, so that
+     * every page directory copied from kern_pgdir sees the same slots.
+     */
+    static_assert(KMAPSIZE + NCPU * (KSTKSIZE + KSTKGAP) <= PTSIZE);
+    kmap_ptes = pgdir_walk(kern_pgdir, (void *) KMAPBASE, CREATE_NORMAL);
+    assert(kmap_ptes && PTX(KMAPBASE) == 0);
+
+    /*********************************************************************
+     * Likewise the page table of the MMIO region, which mmio_map_region
+     * fills in later, e.g. with the LAPIC. No kernel page table may be
+     * created after env_init builds the page directory pool.
+     */
+    static_assert(MMIOLIM - MMIOBASE == PTSIZE && MMIOBASE % PTSIZE == 0);
+    assert(pgdir_walk(kern_pgdir, (void *) MMIOBASE, CREATE_NORMAL));
+
     /*********************************************************************
      * Map all of physical memory at KERNBASE.
      * Ie.  the VA range [KERNBASE, 2^32) should map to
@@ -257,8 +354,11 @@ void mem_init(void)
      */
     boot_map_region(kern_pgdir, KERNBASE, (0xffffffff - KERNBASE) + 1, 0, PTE_W);
 
-    /* Enable Page Size Extensions for huge page support */
-    lcr4(rcr4() | CR4_PSE);
+    /* Enable Page Size Extensions for huge page support. entry.S turned them
+     * on already; the 4MB pages of the direct map above depend on them.
+     * Also enable global pages: the mappings above are the same in every
+     * address space, so they can stay in the TLB across CR3 loads. */
+    lcr4(rcr4() | CR4_PSE | CR4_PGE);
 
     /* Check that the initial page directory has been set up correctly. */
     check_kern_pgdir();
@@ -270,7 +370,7 @@ void mem_init(void)
      *
      * If the machine reboots at this point, you've probably set up your
      * kern_pgdir wrong. */
-    lcr3(PADDR(kern_pgdir));
+    load_pgdir(kern_pgdir);
 
     check_page_free_list(0);
 
@@ -286,19 +386,84 @@ void mem_init(void)
 
     /* Check for huge page support */
     check_page_hugepages();
+
+    /* Check page table sharing for fork */
+    check_pt_share();
 }
 
 /***************************************************************
  * Tracking of physical pages.
  * The 'pages' array has one 'struct page_info' entry per physical page.
- * Pages are reference counted, and free pages are kept on a linked list.
+ * Pages are reference counted, and free pages are kept in a buddy allocator
+ * with one free list per block order.
  ***************************************************************/
 
+/*
+ * Helpers to maintain the per-order free lists.
+ */
+static void free_list_push(struct page_info *pp, unsigned order)
+{
+    struct free_area *area = &free_area[page_zone(pp)][order];
+
+    pp->flags = PAGE_FREE;
+    pp->pp_order = order;
+    pp->pp_prev = NULL;
+    pp->pp_link = area->free_list;
+    if (area->free_list)
+        area->free_list->pp_prev = pp;
+    area->free_list = pp;
+    area->nr_free += 1;
+}
+
+static void free_list_remove(struct page_info *pp, unsigned order)
+{
+    struct free_area *area = &free_area[page_zone(pp)][order];
+
+    if (pp->pp_prev)
+        pp->pp_prev->pp_link = pp->pp_link;
+    else
+        area->free_list = pp->pp_link;
+    if (pp->pp_link)
+        pp->pp_link->pp_prev = pp->pp_prev;
+
+    pp->pp_link = NULL;
+    pp->pp_prev = NULL;
+    pp->flags = 0;
+    area->nr_free -= 1;
+}
+
+/*
+ * Returns the block of 'order' pages starting at 'pp' to the free lists,
+ * merging it with its buddy for as long as the buddy is free as a whole.
+ */
+static void buddy_free(struct page_info *pp, unsigned order)
+{
+    size_t idx = pp - pages;
+
+    while (order < MAX_ORDER) {
+        size_t buddy_idx = idx ^ (1 << order);
+        struct page_info *buddy = &pages[buddy_idx];
+
+        // buddy must exist and be a free block of exactly this order
+        if (buddy_idx >= npages)
+            break;
+        if (!(buddy->flags & PAGE_FREE) || buddy->pp_order != order)
+            break;
+
+        // merge the two halves into one block of the next order
+        free_list_remove(buddy, order);
+        idx &= ~(1 << order);
+        order += 1;
+    }
+
+    free_list_push(&pages[idx], order);
+}
+
 /*
  * Initialize page structure and memory free list.
  * After this is done, NEVER use boot_alloc again.  ONLY use the page
  * allocator functions below to allocate and deallocate physical
- * memory via the page_free_list.
+ * memory via the buddy free lists.
  */
 void page_init(void)
 {
@@ -312,24 +477,36 @@ void page_init(void)
      *     Some of it is in use, some is free. Where is the kernel in physical
      *     memory?  Which pages are already in use for page tables and other
      *     data structures?
+     *
+     * Pages are released from the top of memory downwards. Every block that
+     * ends up on a free list is then below all blocks already on that list,
+     * so each list is sorted by address and early allocations come from the
+     * low 8MB that entry_pgdir maps.
      */
 
     // helper macros
-    #define MARK_USED(i) { pages[i].pp_ref = 1; pages[i].pp_link = 0; }
-    #define MARK_FREE(i) { pages[i].pp_ref = 0; \
-                           pages[i].pp_link = page_free_list; \
-                           page_free_list = &pages[i]; }
-
-    // iterate over all pages
-    size_t i = 0;
-
-    // 1 mark physical page 0 as USED
-    MARK_USED(i)
+    #define MARK_USED(i) { pages[i].pp_ref = 1; pages[i].pp_link = 0; \
+                           pages[i].pp_prev = 0; pages[i].flags = 0; \
+                           pages[i].pp_order = 0; }
+    #define MARK_FREE(i) { pages[i].pp_ref = 0; pages[i].pp_order = 0; \
+                           buddy_free(&pages[i], 0); }
+
+    // first page not handed out by boot_alloc
+    size_t boot_end = (0xf0000000 ^ (uint32_t) boot_alloc(0)) / PGSIZE;
+
+    // start with empty free lists and unmarked pages
+    memset(free_area, 0, sizeof(free_area));
+    memset(pages, 0, npages * sizeof(struct page_info));
+
+    // visit all pages, highest first
+    size_t i = npages;
+    while (i-- > 0) {
+        // 1 mark physical page 0 as USED
+        if (i == 0)
+            MARK_USED(i)
 
-    // visit all other pages
-    while (++i < npages) {
         // 2 mark remainder of base memory as FREE
-        if (i < npages_basemem)
+        else if (i < npages_basemem)
             MARK_FREE(i)
 
         // 3 mark IO hole as USED
@@ -337,16 +514,12 @@ void page_init(void)
             MARK_USED(i)
 
         // 4-1 mark the space allocated by boot_alloc as USED
-        else if (i < (0xf0000000 ^ (uint32_t) boot_alloc(0)) / PGSIZE)
+        else if (i < boot_end)
             MARK_USED(i)
 
         // 4-2 mark the remaining space as FREE
-        else if (i >= (0xf0000000 ^ (uint32_t) boot_alloc(0)) / PGSIZE)
-            MARK_FREE(i)
-
-        // sanity check: did I forget to mark a page?
         else
-            panic("page_init: page %u was left unmarked.", i);
+            MARK_FREE(i)
     }
 
     return;
@@ -357,90 +530,296 @@ void page_init(void)
 }
 
 /*
- * Allocates a physical page.
- * (Hastily rewritten for lab 2 to align hugepages on 4MB boundaries.)
- * TODO: This function is not very nice. Refactor when I have time!
- *
- * ALLOC_ZERO:      fills the returned physical page with '\0' bytes.
- * ALLOC_PREMAPPED: return a physical page from the initial pool of mapped pages
- * ALLOC_HUGE:      returns a huge page of 4MB
+ * Takes a block of (1 << order) pages of 'zone' off the free lists.
+ * The smallest free block that fits is taken and split in halves until it has
+ * the requested order; the unused upper halves go back on the free lists.
+ * Caller must hold page_lock. Returns NULL if no block is large enough.
  */
-struct page_info *page_alloc(int alloc_flags)
+static struct page_info *buddy_alloc(int zone, unsigned order)
 {
-    if (alloc_flags & ALLOC_PREMAPPED)
-        panic("premapped page request\n");
+    struct free_area *area = free_area[zone];
+
+    // find the smallest order with a free block
+    unsigned o = order;
+    while (o <= MAX_ORDER && !area[o].free_list)
+        o++;
 
     // no free memory
-    if (!page_free_list)
+    if (o > MAX_ORDER)
         return NULL;
 
-    // set default params
-    struct page_info *target = NULL;
-    uint32_t size = 1;
-
-    // a huge page was requested
-    if (alloc_flags & ALLOC_HUGE) {
-        for (size_t i = 0; i < npages; i += 1024) {
-            // check for 1024 consecutive pages
-            size_t x = i;
-            while (x < i + 1023)
-                if (pages[x++].pp_link == NULL)
-                    break;
-
-            // if we found less, this batch is not suitable
-            if (x != i + 1023)
-                continue;
-
-            // remember pointers
-            struct page_info *start = &pages[i];
-            struct page_info *end = &pages[x];
-
-            // ensure page_free_list does not point inside the hugepage
-            while (page_free_list >= start && page_free_list <= end)
-                page_free_list = page_free_list->pp_link;
-
-            // ensure no page_info struct points inside the hugepage
-            for (size_t a = 0; a < npages; a++)
-                while (pages[a].pp_link >= start && pages[a].pp_link <= end)
-                    pages[a].pp_link = pages[a].pp_link->pp_link;
-
-            // clear the pp_link of all pages that make up hugepage
-            for (size_t n = i; n <= x; n++)
-                pages[n].pp_link = NULL;
-
-            // mark first page of hugepage, needed for page_free
-            pages[i].flags |= ALLOC_HUGE;
-
-            // set params accordingly
-            target = start;
-            size = 1024;
-
-            // done, we found a valid hugepage
+    struct page_info *target = area[o].free_list;
+    free_list_remove(target, o);
+
+    // split, returning the upper half to the free lists each time
+    while (o > order) {
+        o -= 1;
+        free_list_push(target + (1 << o), o);
+    }
+
+    target->pp_order = order;
+    return target;
+}
+
+/*
+ * Takes a page off the pre-zeroed pool. Caller must hold page_lock.
+ * Returns NULL if the pool is empty.
+ */
+static struct page_info *zero_pool_pop(void)
+{
+    struct page_info *pp = zero_list;
+
+    if (!pp)
+        return NULL;
+
+    zero_list = pp->pp_link;
+    nr_zero -= 1;
+    pp->pp_link = NULL;
+    pp->flags = 0;
+    return pp;
+}
+
+/*
+ * Moves up to PCP_BATCH pages of 'zone' from the buddy allocator into the
+ * cache. Pre-zeroed pages are only used once the buddy allocator runs dry.
+ */
+static void page_cache_refill(struct page_cache *pc, int zone)
+{
+    spin_lock(&page_lock);
+    for (size_t i = 0; i < PCP_BATCH && pc->count < PCP_HIGH; i++) {
+        struct page_info *pp = buddy_alloc(zone, 0);
+        if (!pp && zone == ZONE_NORMAL)
+            pp = zero_pool_pop();
+        if (!pp)
             break;
+        pp->flags = PAGE_CACHED;
+        pc->pages[pc->count++] = pp;
+    }
+    spin_unlock(&page_lock);
+
+    pc->refills += 1;
+}
+
+/*
+ * Gives the 'n' coldest pages (bottom of the stack) back to the buddy
+ * allocator.
+ */
+static void page_cache_drain(struct page_cache *pc, size_t n)
+{
+    if (n > pc->count)
+        n = pc->count;
+    if (!n)
+        return;
+
+    spin_lock(&page_lock);
+    for (size_t i = 0; i < n; i++) {
+        pc->pages[i]->flags = 0;
+        buddy_free(pc->pages[i], 0);
+    }
+    spin_unlock(&page_lock);
+
+    memmove(&pc->pages[0], &pc->pages[n],
+            (pc->count - n) * sizeof(pc->pages[0]));
+    pc->count -= n;
+    pc->drains += 1;
+}
+
+/*
+ * Returns the pages of every CPU cache to the buddy allocator. Only safe
+ * while no other CPU allocates, e.g. during boot or from the monitor.
+ */
+void page_cache_drain_all(void)
+{
+    for (size_t cpu = 0; cpu < NCPU; cpu++)
+        for (int zone = 0; zone < NZONES; zone++)
+            page_cache_drain(&page_caches[cpu][zone],
+                             page_caches[cpu][zone].count);
+}
+
+/*
+ * Takes a block of (1 << order) pages from 'zone'. Order-0 requests are
+ * served from the local CPU's page cache for that zone, which is refilled
+ * from the buddy allocator in batches when it runs empty.
+ */
+static struct page_info *zone_alloc(int zone, unsigned order)
+{
+    struct page_info *target;
+
+    if (order == 0) {
+        struct page_cache *pc = &page_caches[cpunum()][zone];
+
+        if (pc->count) {
+            pc->alloc_hits += 1;
+        } else {
+            pc->alloc_misses += 1;
+            page_cache_refill(pc, zone);
+        }
+
+        // no free memory
+        if (!pc->count)
+            return NULL;
+
+        return pc->pages[--pc->count];
+    }
+
+    spin_lock(&page_lock);
+    target = buddy_alloc(zone, order);
+    spin_unlock(&page_lock);
+    return target;
+}
+
+/*
+ * Takes a block of (1 << order) pages from high memory if 'alloc_flags' allows
+ * and there is any, and from the direct-mapped zone otherwise.
+ */
+static struct page_info *zones_alloc(unsigned order, int alloc_flags)
+{
+    struct page_info *target = NULL;
+
+    if ((alloc_flags & ALLOC_HIGHMEM) && npages > npages_lowmem)
+        target = zone_alloc(ZONE_HIGHMEM, order);
+    if (!target)
+        target = zone_alloc(ZONE_NORMAL, order);
+    return target;
+}
+
+/*
+ * Bumps the counter of every ALLOC_* flag set in 'alloc_flags'.
+ */
+static void page_stats_count(uint32_t *counters, int alloc_flags)
+{
+    for (int i = 0; i < PSTAT_NFLAGS; i++)
+        if (alloc_flags & (1 << i))
+            counters[i] += 1;
+}
+
+/*
+ * Fills 'n' pages starting at 'pp' with zeroes. High memory pages are
+ * cleared one at a time through the kmap window.
+ */
+static void page_zero(struct page_info *pp, size_t n)
+{
+    if (page_zone(pp) == ZONE_NORMAL) {
+        memset(page2kva(pp), 0, n * PGSIZE);
+        return;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        void *kva = kmap(pp + i);
+        memset(kva, 0, PGSIZE);
+        kunmap(kva);
+    }
+}
+
+/*
+ * Allocates a block of (1 << order) physically contiguous pages.
+ * Supports the same flags as page_alloc. ALLOC_HUGE is implied for blocks of
+ * MAX_ORDER. With ALLOC_HIGHMEM the block comes from high memory if there is
+ * any left, and from the direct-mapped zone otherwise.
+ */
+struct page_info *page_alloc_order(unsigned order, int alloc_flags)
+{
+    struct page_stats *ps = &cpu_stats[cpunum()];
+    struct page_info *target;
+
+    if (alloc_flags & ALLOC_PREMAPPED)
+        panic("premapped page request\n");
+
+    if (order == MAX_ORDER)
+        alloc_flags |= ALLOC_HUGE;
+
+    if (order > MAX_ORDER) {
+        page_stats_count(ps->flag_failures, alloc_flags);
+        ps->failures += 1;
+        return NULL;
+    }
+
+    // zero-fill requests first try the pool the zeroing thread prepared
+    if (order == 0 && (alloc_flags & ALLOC_ZERO)) {
+        spin_lock(&page_lock);
+        target = zero_pool_pop();
+        bool wake = nr_zero < ZERO_POOL_LOW;
+        spin_unlock(&page_lock);
+
+        if (wake && zero_thread)
+            kernelthread_wakeup(zero_thread);
+
+        if (target) {
+            target->pp_order = 0;
+            page_stats_count(ps->flag_allocs, alloc_flags);
+            ps->allocs += 1;
+            ps->zero_pool_hits += 1;
+            return target;
         }
     }
 
-    // a normal page was requested
-    else {
-        size = 1;
-        target = page_free_list;
-        page_free_list = page_free_list->pp_link;
-        target->pp_link = NULL;
+    target = zones_alloc(order, alloc_flags);
+
+    // out of memory: drop clean binary pages and swap out anonymous pages of
+    // user environments, then retry
+    if (!target && order == 0 && !(alloc_flags & ALLOC_NORECLAIM)) {
+        size_t n = page_reclaim(RECLAIM_BATCH);
+
+        ps->reclaim_runs += 1;
+        ps->reclaimed += n;
+        if (n)
+            target = zones_alloc(order, alloc_flags);
+    }
+
+    // no free memory
+    if (!target) {
+        page_stats_count(ps->flag_failures, alloc_flags);
+        ps->failures += 1;
+        return NULL;
     }
 
+    page_stats_count(ps->flag_allocs, alloc_flags);
+    ps->allocs += 1;
+
+    // mark first page of hugepage, needed for page_insert, and let the
+    // other pages refer to it so they can be mapped on their own
+    target->flags = (order == MAX_ORDER) ? ALLOC_HUGE : 0;
+    if (order == MAX_ORDER)
+        for (size_t i = 1; i < (1 << order); i++)
+            target[i].flags = PAGE_TAIL;
+
     // zero-fill if requested
-    if (alloc_flags & ALLOC_ZERO)
-        memset(page2kva(target), 0, size * PGSIZE);
+    if (alloc_flags & ALLOC_ZERO) {
+        uint64_t start = read_tsc();
+        page_zero(target, 1 << order);
+        ps->zero_cycles += read_tsc() - start;
+        ps->zero_pages += 1 << order;
+    }
 
     // return pointer to (first) page
     return target;
 }
 
 /*
- * Return a page to the free list.
+ * Allocates a physical page.
+ *
+ * ALLOC_ZERO:      fills the returned physical page with '\0' bytes.
+ * ALLOC_PREMAPPED: return a physical page from the initial pool of mapped pages
+ * ALLOC_HUGE:      returns a huge page of 4MB
+ * ALLOC_HIGHMEM:   prefer a page above the direct map; the caller must not
+ *                  use page2kva on it, only user mappings or kmap
+ * ALLOC_NORECLAIM: fail rather than reclaim user pages when out of memory
+ */
+struct page_info *page_alloc(int alloc_flags)
+{
+    return page_alloc_order(alloc_flags & ALLOC_HUGE ? MAX_ORDER : 0,
+                            alloc_flags);
+}
+
+/*
+ * Return a page (or the block it heads) to the free lists.
+ * Single pages go to the local CPU's page cache; when it is full its coldest
+ * PCP_BATCH pages are drained to the buddy allocator first.
  */
 void page_free(struct page_info *pp)
 {
+    struct page_stats *ps = &cpu_stats[cpunum()];
+
     // sanity checks
     if (pp->pp_link)
         panic("page_free: expect pp_link to be NULL but was %p\n", pp->pp_link);
@@ -448,51 +827,239 @@ void page_free(struct page_info *pp)
     if (pp->pp_ref)
         panic("page_free: this page still has %u refs\n", pp->pp_ref);
 
-    // free a huge page
-    if (pp->flags & ALLOC_HUGE) {
-        // find index number of this page
-        size_t index;
-        for (index = 0; index < npages; index++)
-            if (pp == &pages[index])
-              break;
-
-        // chain the pages together and add the chain to page_free_list
-        for (size_t i = 0; i < 1024; i++)
-            pages[index + i].pp_link = &pages[index + i + 1];
-
-        // workaround - reinsert hugepages at the end of freelist
-        // to fix bugs with lab2
-        pages[index + 1023].pp_link = NULL;
-        struct page_info *x = page_free_list;
-        if (x) {
-            while (x->pp_link)
-                x = x->pp_link;
-            x->pp_link = &pages[index];
+    if (pp->flags & (PAGE_FREE | PAGE_CACHED | PAGE_ZEROED))
+        panic("page_free: page %p is already free\n", pp);
+
+    if (pp->flags & PAGE_TAIL)
+        panic("page_free: page %p is part of a huge page\n", pp);
+
+    if (pp->flags & PAGE_BINCACHE)
+        panic("page_free: page %p is still in the binary page cache\n", pp);
+
+    ps->frees += 1;
+    if (pp->pp_order == MAX_ORDER)
+        ps->flag_frees[PSTAT_HUGE] += 1;
+    if (page_zone(pp) == ZONE_HIGHMEM)
+        ps->flag_frees[PSTAT_HIGHMEM] += 1;
+
+    if (pp->pp_order == 0) {
+        struct page_cache *pc = &page_caches[cpunum()][page_zone(pp)];
+
+        if (pc->count == PCP_HIGH)
+            page_cache_drain(pc, PCP_BATCH);
+
+        pp->flags = PAGE_CACHED;
+        pc->pages[pc->count++] = pp;
+        pc->free_hits += 1;
+        return;
+    }
+
+    if (pp->pp_order == MAX_ORDER)
+        for (size_t i = 1; i < (1 << MAX_ORDER); i++)
+            pp[i].flags = 0;
+
+    spin_lock(&page_lock);
+    buddy_free(pp, pp->pp_order);
+    spin_unlock(&page_lock);
+}
+
+/*
+ * Body of the page zeroing kernel thread. Takes dirty pages from the buddy
+ * allocator, clears them and parks them on zero_list, yielding after every
+ * ZERO_BATCH pages. Sleeps once the pool is full or memory runs out;
+ * page_alloc wakes it when the pool drops below ZERO_POOL_LOW.
+ */
+static void page_zero_thread(void)
+{
+    while (1) {
+        for (size_t i = 0; i < ZERO_BATCH; i++) {
+            struct page_info *pp = NULL;
+
+            spin_lock(&page_lock);
+            if (nr_zero < ZERO_POOL_HIGH)
+                pp = buddy_alloc(ZONE_NORMAL, 0);
+            spin_unlock(&page_lock);
+
+            if (!pp) {
+                kernelthread_sleep();
+                break;
+            }
+
+            // the expensive part runs without holding the lock
+            uint64_t start = read_tsc();
+            memset(page2kva(pp), 0, PGSIZE);
+            cpu_stats[cpunum()].bg_zero_cycles += read_tsc() - start;
+            cpu_stats[cpunum()].bg_zero_pages += 1;
+
+            spin_lock(&page_lock);
+            pp->flags = PAGE_ZEROED;
+            pp->pp_link = zero_list;
+            zero_list = pp;
+            nr_zero += 1;
+            spin_unlock(&page_lock);
         }
-        else
-            page_free_list = &pages[index];
 
-        /*
-        pages[index + 1023].pp_link = page_free_list;
-        page_free_list = &pages[index];
-        */
+        kernelthread_yield();
+    }
+}
+
+/*
+ * Starts the page zeroing kernel thread as the scheduler's idle thread.
+ */
+void page_zero_init(void)
+{
+    zero_thread = kernelthread_create(page_zero_thread);
+    sched_set_idle(zero_thread);
+}
+
+/*
+ * Returns the number of free pages, a snapshot for callers that keep pages
+ * cached only while memory is plentiful.
+ */
+size_t page_free_count(void)
+{
+    size_t n;
+
+    spin_lock(&page_lock);
+    n = count_free_pages();
+    spin_unlock(&page_lock);
+    return n;
+}
+
+/*
+ * Refreshes the statistics page at UPSTATS: takes a snapshot of the free
+ * lists, computes the fragmentation index of every order and sums up the
+ * per-CPU counters.
+ */
+void page_stats_update(void)
+{
+    struct page_stats snap;
+    size_t usable = 0;
+    int zone, order;
+    size_t cpu;
 
+    if (!page_stats)
         return;
+
+    memset(&snap, 0, sizeof(snap));
+    snap.generation = page_stats->generation + 1;
+    snap.npages = npages;
+    snap.npages_high = npages - npages_lowmem;
+
+    spin_lock(&page_lock);
+    for (zone = 0; zone < NZONES; zone++) {
+        for (order = 0; order <= MAX_ORDER; order++) {
+            size_t nr = free_area[zone][order].nr_free;
+
+            snap.nr_blocks[order] += nr;
+            snap.nfree += nr << order;
+            if (zone == ZONE_HIGHMEM)
+                snap.nfree_high += nr << order;
+        }
+    }
+    snap.nfree_zeroed = nr_zero;
+    spin_unlock(&page_lock);
+
+    // the caches of other CPUs are read without their owner's cooperation;
+    // the numbers may be slightly off, which is fine for statistics
+    for (cpu = 0; cpu < NCPU; cpu++) {
+        for (zone = 0; zone < NZONES; zone++) {
+            snap.nfree_cached += page_caches[cpu][zone].count;
+            if (zone == ZONE_HIGHMEM)
+                snap.nfree_high += page_caches[cpu][zone].count;
+        }
+    }
+    snap.nfree += snap.nfree_cached + snap.nfree_zeroed;
+
+    // cached and pre-zeroed pages only serve order-0 requests
+    for (order = MAX_ORDER; order >= 0; order--) {
+        usable += snap.nr_blocks[order] << order;
+        if (order == 0)
+            usable += snap.nfree_cached + snap.nfree_zeroed;
+        snap.frag_index[order] = snap.nfree ?
+            (snap.nfree - usable) * 1000 / snap.nfree : 0;
     }
 
-    // free a normal page
-    pp->pp_link = page_free_list;
-    page_free_list = pp;
+    for (cpu = 0; cpu < NCPU; cpu++) {
+        struct page_stats *ps = &cpu_stats[cpu];
 
-    return;
+        snap.allocs += ps->allocs;
+        snap.frees += ps->frees;
+        snap.failures += ps->failures;
+        for (int i = 0; i < PSTAT_NFLAGS; i++) {
+            snap.flag_allocs[i] += ps->flag_allocs[i];
+            snap.flag_frees[i] += ps->flag_frees[i];
+            snap.flag_failures[i] += ps->flag_failures[i];
+        }
+        snap.zero_pool_hits += ps->zero_pool_hits;
+        snap.zero_pages += ps->zero_pages;
+        snap.zero_cycles += ps->zero_cycles;
+        snap.bg_zero_pages += ps->bg_zero_pages;
+        snap.bg_zero_cycles += ps->bg_zero_cycles;
+        snap.reclaim_runs += ps->reclaim_runs;
+        snap.reclaimed += ps->reclaimed;
+    }
+    swap_stats(&snap);
+
+    *page_stats = snap;
+}
+
+/*
+ * Returns a kernel virtual address for page 'pp'. Low memory pages are
+ * reached through the direct map; high memory pages are mapped into the next
+ * free slot of the local CPU's kmap window. Mappings are strictly nested:
+ * every kmap must be undone by kunmap in reverse order before the kernel
+ * leaves the current CPU.
+ */
+void *kmap(struct page_info *pp)
+{
+    size_t cpu = cpunum();
+    size_t slot;
+    void *kva;
+
+    if (page_zone(pp) == ZONE_NORMAL)
+        return page2kva(pp);
+
+    if (kmap_depth[cpu] == KMAP_SLOTS)
+        panic("kmap: out of slots on CPU %d\n", cpu);
+
+    slot = cpu * KMAP_SLOTS + kmap_depth[cpu]++;
+    kva = (void *) (KMAPBASE + slot * PGSIZE);
+    kmap_ptes[slot] = page2pa(pp) | PTE_W | PTE_P | PTE_G;
+    invlpg(kva);
+    return kva;
+}
+
+/*
+ * Releases a mapping returned by kmap. Only the most recent mapping of the
+ * local CPU may be released.
+ */
+void kunmap(void *kva)
+{
+    size_t cpu = cpunum();
+    size_t slot;
+
+    // direct-mapped pages were never put in the window
+    if ((uintptr_t) kva < KMAPBASE || (uintptr_t) kva >= KMAPBASE + KMAPSIZE)
+        return;
+
+    slot = ((uintptr_t) kva - KMAPBASE) / PGSIZE;
+    if (!kmap_depth[cpu] || slot != cpu * KMAP_SLOTS + kmap_depth[cpu] - 1)
+        panic("kunmap: %p is not the last kmap of CPU %d\n", kva, cpu);
+
+    kmap_ptes[slot] = 0;
+    invlpg(kva);
+    kmap_depth[cpu] -= 1;
 }
 
 /*
  * Decrement the reference count on a page,
  * freeing it if there are no more refs.
+ * References to any page of a huge page are counted on its first page.
  */
 void page_decref(struct page_info* pp)
 {
+    pp = page_head(pp);
     if (--pp->pp_ref == 0)
         page_free(pp);
 }
@@ -539,6 +1106,11 @@ pte_t *pgdir_walk(pde_t *pgdir, const void *va, int create)
     if ((*pde & PTE_P) && (*pde & PTE_PS))
         return (pte_t *) pde;
 
+    // page tables shared after fork are copied before they are written
+    if (create == CREATE_NORMAL && (*pde & PDE_COW)
+        && pt_unshare(pgdir, va) < 0)
+        return NULL;
+
     // directory entry does not point to page table
     if (!(*pde & PTE_P)) {
 
@@ -575,7 +1147,12 @@ pte_t *pgdir_walk(pde_t *pgdir, const void *va, int create)
  *
  * This function is only intended to set up the ``static'' mappings
  * above UTOP. As such, it should *not* change the pp_ref field on the
- * mapped pages.
+ * mapped pages. Being the same in every address space, the mappings are
+ * made global (PTE_G), so context switches keep their TLB entries.
+ *
+ * Wherever va and pa are both 4MB aligned, at least 4MB remain and no page
+ * table exists yet, a single 4MB page is mapped instead of 1024 PTEs. This
+ * needs CR4_PSE, which entry.S enables.
  *
  * Hint: the TA solution uses pgdir_walk
  */
@@ -584,9 +1161,19 @@ static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size,
 {
     // sanity check
     assert(size % PGSIZE == 0);
+    perm |= PTE_G;
 
     // perform the static mapping
     for (size_t i = 0; i < size; i += PGSIZE) {
+        pde_t *pde = &pgdir[PDX(va + i)];
+
+        if ((va + i) % PTSIZE == 0 && (pa + i) % PTSIZE == 0
+            && size - i >= PTSIZE && !(*pde & PTE_P)) {
+            *pde = (pa + i) | perm | PTE_P | PTE_PS;
+            i += PTSIZE - PGSIZE;
+            continue;
+        }
+
         pte_t *pt = pgdir_walk(pgdir, (char *) va + i, CREATE_NORMAL);
 
         if (!pt)
@@ -617,29 +1204,51 @@ static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size,
  * RETURNS:
  *   0 on success
  *   -E_NO_MEM, if page table couldn't be allocated
+ *   -E_INVAL, if 'perm' asks for a huge mapping of a page that is not huge,
+ *     or where a page table exists already
  *
  * Hint: The TA solution is implemented using pgdir_walk, page_remove,
  * and page2pa.
  *
  * Also add support for huge page insertion.
+ *
+ * A huge page is mapped as a whole if 'perm' contains PTE_PS; otherwise 'pp'
+ * is mapped as a single 4K page, even if it is part of a huge page. In both
+ * cases the reference is counted on the first page of the huge page.
  */
 int page_insert(pde_t *pgdir, struct page_info *pp, void *va, int perm)
 {
     // distinguish between normal and hugepages
-    uint32_t huge = pp->flags & ALLOC_HUGE ? PTE_PS : 0;
+    uint32_t huge = perm & PTE_PS;
+
+    // these mappings belong to one address space and must not survive a
+    // CR3 load
+    perm &= ~PTE_G;
+    if (huge && !(pp->flags & ALLOC_HUGE))
+        return -E_INVAL;
+
+    // reference counter; taken before allocating a page table, so that
+    // reclaim cannot free 'pp' under our feet
+    page_head(pp)->pp_ref += 1;
 
     // obtain page table entry
     pte_t *pte = huge ? pgdir_walk(pgdir, va, CREATE_HUGE) :
                         pgdir_walk(pgdir, va, CREATE_NORMAL);
 
     // if allocation fails
-    if (!pte)
+    if (!pte) {
+        page_head(pp)->pp_ref -= 1;
         return -E_NO_MEM;
+    }
 
-    // reference counter
-    pp->pp_ref += 1;
+    // a huge page cannot go where a page table maps 4K pages already
+    if (huge && pte != (pte_t *) &pgdir[PDX(va)]) {
+        page_head(pp)->pp_ref -= 1;
+        return -E_INVAL;
+    }
 
-    // va->pa mapping already existed
+    // va->pa mapping already existed; its page table is no longer shared
+    // after pgdir_walk, so this cannot fail
     if (*pte & PTE_P)
         page_remove(pgdir, va);
 
@@ -657,6 +1266,8 @@ int page_insert(pde_t *pgdir, struct page_info *pp, void *va, int perm)
  * but should not be used by most callers.
  *
  * Return NULL if there is no page mapped at va.
+ * Inside a huge mapping, the 4K page backing 'va' is returned and the stored
+ * pte is the page directory entry.
  *
  * Hint: the TA solution uses pgdir_walk and pa2page.
  */
@@ -673,6 +1284,9 @@ struct page_info *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
     if (pte_store)
       *pte_store = pte;
 
+    if (*pte & PTE_PS)
+        return pa2page(PTE_ADDR(*pte)) + PTX(va);
+
     return pa2page(PTE_ADDR(*pte));
 }
 
@@ -690,36 +1304,591 @@ struct page_info *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
  *
  * Hint: The TA solution is implemented using page_lookup,
  *  tlb_invalidate, and page_decref.
+ *
+ * RETURNS:
+ *   0 on success
+ *   -E_NO_MEM, if a page table shared after fork couldn't be copied; nothing
+ *     is unmapped then
  */
-void page_remove(pde_t *pgdir, void *va)
+int page_remove(pde_t *pgdir, void *va)
 {
+    // the entry changes, so a page table shared after fork is copied first
+    if (pt_unshare(pgdir, va) < 0)
+        return -E_NO_MEM;
+
     // retrieve pagetable entry and physical page
     pte_t *pte;
     struct page_info *pp = page_lookup(pgdir, va, &pte);
 
-    if (!pp)
-        return;
+    // a swapped out page only holds on to its swap slot
+    if (!pp) {
+        pte = pgdir_walk(pgdir, va, 0);
+        if (pte && PTE_SWAPPED(*pte)) {
+            swap_free(*pte);
+            *pte = 0;
+        }
+        return 0;
+    }
 
     // decrement refs and remove page if 0
     page_decref(pp);
 
-    // remove page table entry
-    // TODO: Setting entire line to 0 might be better?
-    *pte ^= PTE_P;
+    // remove page table entry; clear it entirely so that no stale bits can
+    // be mistaken for a swap entry
+    *pte = 0;
 
     // flush tlb
     tlb_invalidate(pgdir, va);
+    return 0;
 }
 
 /*
- * Invalidate a TLB entry, but only if the page tables being
- * edited are the ones currently in use by the processor.
+ * Replaces the huge mapping covering 'va', if any, with a page table that maps
+ * the same 4K frames with the same permissions. Every new PTE holds its own
+ * reference on the huge page, so parts of it can then be unmapped or copied
+ * on write one 4K page at a time.
+ *
+ * RETURNS:
+ *   0 on success, or if 'va' is not covered by a huge mapping
+ *   -E_NO_MEM, if the page table couldn't be allocated
+ */
+int page_split(pde_t *pgdir, void *va)
+{
+    pde_t *pde = &pgdir[PDX(va)];
+    struct page_info *head, *pt;
+    pte_t *ptes;
+    int perm;
+
+    if (!(*pde & PTE_P) || !(*pde & PTE_PS))
+        return 0;
+
+    pt = page_alloc(0);
+    if (!pt)
+        return -E_NO_MEM;
+
+    head = pa2page(PTE_ADDR(*pde));
+    perm = *pde & PTE_SYSCALL;
+    ptes = page2kva(pt);
+    for (size_t i = 0; i < NPTENTRIES; i++)
+        ptes[i] = page2pa(head + i) | perm;
+
+    head->pp_ref += NPTENTRIES - 1;
+    pt->pp_ref = 1;
+    *pde = page2pa(pt) | PTE_P | PTE_U | PTE_W;
+
+    // a single invlpg drops the whole 4MB TLB entry
+    tlb_invalidate(pgdir, ROUNDDOWN(va, PTSIZE));
+    return 0;
+}
+
+/*
+ * Returns whether 'pp', mapped at 'va' in 'pgdir', may be written in place:
+ * no other mapping refers to it. The 4K pages of a split huge page all count
+ * on the head, so for them this holds if every reference to the huge page
+ * comes from the page table mapping 'va'.
+ */
+bool page_private(pde_t *pgdir, struct page_info *pp, void *va)
+{
+    struct page_info *head = page_head(pp);
+    pde_t pde = pgdir[PDX(va)];
+    physaddr_t base = page2pa(head);
+    size_t n = 0;
+
+    if (!(head->flags & ALLOC_HUGE) || (pde & PTE_PS))
+        return head->pp_ref == 1;
+    if (pde & PDE_COW)
+        return false;
+
+    pte_t *ptes = page2kva(pa2page(PTE_ADDR(pde)));
+    for (size_t i = 0; i < NPTENTRIES; i++)
+        if ((ptes[i] & PTE_P) && PTE_ADDR(ptes[i]) - base < PTSIZE)
+            n++;
+    return n == head->pp_ref;
+}
+
+/*
+ * Loads 'pgdir' into CR3 and records it, so TLB shootdowns know which CPUs
+ * hold entries of which address space.
+ */
+void load_pgdir(pde_t *pgdir)
+{
+    thiscpu->cpu_pgdir = pgdir;
+    lcr3(PADDR(pgdir));
+}
+
+/*
+ * TLB shootdown. Every CPU has a mailbox of addresses to invalidate. A CPU
+ * that changes page tables loaded on other CPUs posts the addresses to their
+ * mailboxes and interrupts them with T_TLBFLUSH, but only if no IPI is
+ * already pending there: requests that pile up before the target gets to
+ * them are coalesced and handled by one IPI. A mailbox that overflows or
+ * holds addresses of several address spaces makes its CPU reload CR3.
+ */
+struct tlb_mailbox {
+    struct spinlock lock;
+    pde_t *pgdir;                   /* address space of the pending entries */
+    size_t nva;                     /* pending entries; above the max, all */
+    uintptr_t va[TLB_FLUSH_MAX];
+    volatile uint32_t posted;       /* requests posted so far */
+    volatile uint32_t done;         /* requests handled so far */
+};
+
+static struct tlb_mailbox tlb_mailboxes[NCPU];
+
+/*
+ * Flushes the whole TLB of the local CPU, global entries included: clearing
+ * CR4_PGE drops them.
+ */
+static void tlb_flush_global(void)
+{
+    uint32_t cr4 = rcr4();
+
+    lcr4(cr4 & ~CR4_PGE);
+    lcr4(cr4);
+}
+
+/*
+ * Flushes 'n' TLB entries of the local CPU, or all entries of 'pgdir' if 'n'
+ * is above TLB_FLUSH_MAX. invlpg also drops global entries, a CR3 reload
+ * does not, so a full flush of kern_pgdir, whose mappings are global,
+ * toggles CR4_PGE instead.
+ */
+static void tlb_flush_local(pde_t *pgdir, const uintptr_t *va, size_t n)
+{
+    if (n <= TLB_FLUSH_MAX)
+        for (size_t i = 0; i < n; i++)
+            invlpg((void *) va[i]);
+    else if (pgdir == kern_pgdir)
+        tlb_flush_global();
+    else
+        lcr3(rcr3());
+}
+
+/*
+ * Adds 'n' entries of 'pgdir' to 'mb', which must be locked.
+ */
+static void tlb_mailbox_post(struct tlb_mailbox *mb, pde_t *pgdir,
+                             const uintptr_t *va, size_t n)
+{
+    if (mb->nva && mb->pgdir != pgdir)
+        n = TLB_FLUSH_MAX + 1;
+    mb->pgdir = pgdir;
+
+    if (mb->nva + n > TLB_FLUSH_MAX)
+        mb->nva = TLB_FLUSH_MAX + 1;
+    else
+        for (size_t i = 0; i < n; i++)
+            mb->va[mb->nva++] = va[i];
+}
+
+/*
+ * Handles the local CPU's mailbox. Called on T_TLBFLUSH, and by CPUs waiting
+ * for a shootdown to complete, so two CPUs shooting at each other with
+ * interrupts disabled cannot deadlock.
+ */
+void tlb_shootdown_handler(void)
+{
+    struct tlb_mailbox *mb = &tlb_mailboxes[cpunum()];
+
+    spin_lock(&mb->lock);
+    // entries of another address space went with the last CR3 switch
+    if (mb->nva > TLB_FLUSH_MAX || mb->pgdir == thiscpu->cpu_pgdir)
+        tlb_flush_local(mb->pgdir, mb->va, mb->nva);
+    mb->nva = 0;
+    mb->done = mb->posted;
+    spin_unlock(&mb->lock);
+}
+
+/*
+ * Invalidates 'n' TLB entries of 'pgdir' on every CPU that has it loaded, or
+ * all of its entries if 'n' is above TLB_FLUSH_MAX, and waits until all CPUs
+ * are done. Changes to kern_pgdir only concern the local CPU, which flushes
+ * them whatever it has loaded: its kernel part is shared by all address
+ * spaces and never changes after boot, except for the per-CPU kmap windows.
+ */
+void tlb_shootdown(pde_t *pgdir, const uintptr_t *va, size_t n)
+{
+    uint32_t wait[NCPU];
+    int me = cpunum();
+
+    if (thiscpu->cpu_pgdir == pgdir || pgdir == kern_pgdir)
+        tlb_flush_local(pgdir, va, n);
+
+    if (pgdir == kern_pgdir)
+        return;
+
+    for (int c = 0; c < ncpu; c++) {
+        struct tlb_mailbox *mb = &tlb_mailboxes[c];
+        bool idle;
+
+        wait[c] = 0;
+        if (c == me || cpus[c].cpu_pgdir != pgdir)
+            continue;
+
+        spin_lock(&mb->lock);
+        idle = mb->done == mb->posted;
+        tlb_mailbox_post(mb, pgdir, va, n);
+        wait[c] = ++mb->posted;
+        spin_unlock(&mb->lock);
+
+        if (idle)
+            lapic_ipi_cpu(c, T_TLBFLUSH);
+    }
+
+    for (int c = 0; c < ncpu; c++) {
+        while (wait[c] && (int32_t) (tlb_mailboxes[c].done - wait[c]) < 0) {
+            if (tlb_mailboxes[me].done != tlb_mailboxes[me].posted)
+                tlb_shootdown_handler();
+            asm volatile("pause");
+        }
+    }
+}
+
+/*
+ * Invalidate a TLB entry on every CPU that has the page tables being edited
+ * loaded.
  */
 void tlb_invalidate(pde_t *pgdir, void *va)
 {
-    /* Flush the entry only if we're modifying the current address space. */
-    if (!curenv || curenv->env_pgdir == pgdir)
-        invlpg(va);
+    uintptr_t a = (uintptr_t) va;
+
+    tlb_shootdown(pgdir, &a, 1);
+}
+
+/*
+ * Flush all non-global TLB entries of 'pgdir' on every CPU that has it
+ * loaded.
+ */
+void tlb_flush(pde_t *pgdir)
+{
+    tlb_shootdown(pgdir, NULL, TLB_FLUSH_MAX + 1);
+}
+
+/*
+ * Collects the TLB entries and pages released by a range operation. Nothing
+ * is flushed or freed until tlb_gather_finish, so a range costs one batched
+ * flush instead of one per page, and no page is freed while a stale TLB
+ * entry could still reach it.
+ */
+struct tlb_gather {
+    pde_t *pgdir;
+    size_t nflush;                      /* TLB entries to invalidate */
+    uintptr_t va[TLB_FLUSH_MAX];        /* their addresses, up to the max */
+    size_t npages;
+    struct page_info *pages[TLB_GATHER_PAGES];
+};
+
+/*
+ * Flushes the gathered TLB entries, then drops the gathered page references.
+ */
+static void tlb_gather_finish(struct tlb_gather *tg)
+{
+    tlb_shootdown(tg->pgdir, tg->va, tg->nflush);
+
+    for (size_t i = 0; i < tg->npages; i++)
+        page_decref(tg->pages[i]);
+
+    tg->nflush = 0;
+    tg->npages = 0;
+}
+
+/*
+ * Records that the TLB entry for 'va' must be flushed and, if 'pp' is given,
+ * that its reference is to be dropped afterwards.
+ */
+static void tlb_gather_add(struct tlb_gather *tg, uintptr_t va,
+                           struct page_info *pp)
+{
+    if (tg->nflush < TLB_FLUSH_MAX)
+        tg->va[tg->nflush] = va;
+    tg->nflush++;
+
+    if (pp) {
+        tg->pages[tg->npages++] = pp;
+        if (tg->npages == TLB_GATHER_PAGES)
+            tlb_gather_finish(tg);
+    }
+}
+
+/*
+ * Makes the gathered range flush the whole TLB.
+ */
+static void tlb_gather_all(struct tlb_gather *tg)
+{
+    tg->nflush = TLB_FLUSH_MAX + 1;
+}
+
+/*
+ * Returns the end of the page table's worth of address space holding 'va',
+ * capped at 'end'.
+ */
+static uintptr_t pde_end(uintptr_t va, uintptr_t end)
+{
+    uintptr_t next = ROUNDDOWN(va, PTSIZE) + PTSIZE;
+    return next && next < end ? next : end;
+}
+
+/*
+ * Shares the user page tables of 'src' with 'dst', for fork. Both page
+ * directories then point to the same page tables, write-protected and marked
+ * PDE_COW; a 4MB region only gets a page table of its own in either of them
+ * when its entries first change (pt_unshare). Huge pages are shared directly,
+ * write-protected. Fork thus costs one pass over the page directory instead of
+ * one over every mapped page.
+ */
+void pt_share(pde_t *dst, pde_t *src)
+{
+    static_assert(UTOP % PTSIZE == 0);
+
+    for (size_t pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+        pde_t pde = src[pdeno];
+
+        if (!(pde & PTE_P))
+            continue;
+
+        // one more reference on the page table or the huge page
+        pa2page(PTE_ADDR(pde))->pp_ref++;
+        pde &= ~PTE_W;
+        if (!(pde & PTE_PS))
+            pde |= PDE_COW;
+        src[pdeno] = dst[pdeno] = pde;
+    }
+
+    tlb_flush(src);
+}
+
+/*
+ * Gives 'pgdir' a page table of its own for the 4MB region holding 'va' if it
+ * shares it after fork. If other page directories still use the page table,
+ * it is copied, and the pages and swap slots it refers to gain a reference;
+ * present pages become copy-on-write in both copies. The last user keeps the
+ * page table. Either way, the region is writable again at the PDE.
+ *
+ * RETURNS:
+ *   0 on success, or if the page table is not shared
+ *   -E_NO_MEM, if the page table couldn't be copied
+ */
+int pt_unshare(pde_t *pgdir, const void *va)
+{
+    pde_t *pde = &pgdir[PDX(va)];
+    struct page_info *pt, *copy;
+    pte_t *src, *dst;
+
+    if ((*pde & (PTE_P | PDE_COW)) != (PTE_P | PDE_COW))
+        return 0;
+
+    pt = pa2page(PTE_ADDR(*pde));
+    if (pt->pp_ref > 1) {
+        copy = page_alloc(0);
+        if (!copy)
+            return -E_NO_MEM;
+
+        src = page2kva(pt);
+        dst = page2kva(copy);
+        for (size_t i = 0; i < NPTENTRIES; i++) {
+            // the other users cannot write through the shared page table,
+            // so clearing PTE_W there needs no TLB flush
+            if (src[i] & PTE_P) {
+                src[i] &= ~PTE_W;
+                page_head(pa2page(PTE_ADDR(src[i])))->pp_ref++;
+            } else if (PTE_SWAPPED(src[i])) {
+                swap_dup(src[i]);
+            }
+            dst[i] = src[i];
+        }
+
+        pt->pp_ref--;
+        copy->pp_ref = 1;
+        *pde = page2pa(copy) | (*pde & (PTE_SYSCALL & ~PTE_AVAIL));
+    }
+
+    *pde = (*pde & ~PDE_COW) | PTE_W;
+    tlb_flush(pgdir);
+    return 0;
+}
+
+/*
+ * Prepares the page tables shared after fork in [start, end) for changes to
+ * their entries with pt_unshare. With 'tg', the entries are being removed: a
+ * shared page table the range covers as a whole is just dropped.
+ *
+ * RETURNS:
+ *   0 on success
+ *   -E_NO_MEM, if a page table couldn't be copied
+ */
+static int pt_unshare_range(pde_t *pgdir, uintptr_t start, uintptr_t end,
+                            struct tlb_gather *tg)
+{
+    for (uintptr_t va = start; va < end; va = pde_end(va, end)) {
+        pde_t *pde = &pgdir[PDX(va)];
+        struct page_info *pt;
+
+        if ((*pde & (PTE_P | PDE_COW)) != (PTE_P | PDE_COW))
+            continue;
+
+        pt = pa2page(PTE_ADDR(*pde));
+        if (tg && va % PTSIZE == 0 && pde_end(va, end) - va == PTSIZE
+            && pt->pp_ref > 1) {
+            pt->pp_ref--;
+            *pde = 0;
+            tlb_gather_all(tg);
+            continue;
+        }
+
+        if (pt_unshare(pgdir, (void *) va) < 0)
+            return -E_NO_MEM;
+    }
+    return 0;
+}
+
+/*
+ * Starts a walk over the entries of 'pgdir' that map [start, end).
+ */
+void pt_walk_init(struct pt_walk *w, pde_t *pgdir, void *start, void *end)
+{
+    w->pgdir = pgdir;
+    w->next = ROUNDDOWN((uintptr_t) start, PGSIZE);
+    w->end = (uintptr_t) end;
+}
+
+/*
+ * Advances the walk to the next entry in its range that is not zero: a PTE,
+ * present or holding a swap entry, or the PDE of a huge mapping. The page
+ * tables are read directly, and page directory entries without a page table
+ * are skipped 4MB at a time.
+ *
+ * Sets w->va to the address the entry maps, w->pte to the entry and w->size
+ * to PGSIZE, or PTSIZE for a huge mapping. The w->va of a huge mapping is
+ * 4MB aligned and may lie below the start of the range.
+ *
+ * Returns false when the range is exhausted.
+ */
+bool pt_walk_next(struct pt_walk *w)
+{
+    while (w->next < w->end) {
+        uintptr_t va = w->next;
+        uintptr_t pt_end = pde_end(va, w->end);
+        pde_t *pde = &w->pgdir[PDX(va)];
+        pte_t *pt;
+
+        w->next = pt_end;
+        if (!(*pde & PTE_P))
+            continue;
+
+        if (*pde & PTE_PS) {
+            w->va = ROUNDDOWN(va, PTSIZE);
+            w->pte = pde;
+            w->size = PTSIZE;
+            return true;
+        }
+
+        pt = KADDR(PTE_ADDR(*pde));
+        for (; va < pt_end; va += PGSIZE) {
+            if (pt[PTX(va)]) {
+                w->va = va;
+                w->pte = &pt[PTX(va)];
+                w->size = PGSIZE;
+                w->next = va + PGSIZE;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Unmaps every page that overlaps [va, va+len) and releases swap entries in
+ * the range. The page tables are walked once with pt_walk, and the TLB is
+ * flushed once for the whole range: per page below TLB_FLUSH_MAX pages, by
+ * reloading CR3 above. Huge mappings that stick out of the range are split
+ * first, so only their part inside the range is released. Page tables
+ * themselves stay allocated, except that a page table shared after fork is
+ * just dropped if the range covers it; one partly covered is copied first.
+ *
+ * RETURNS:
+ *   0 on success
+ *   -E_NO_MEM, if a huge mapping couldn't be split or a shared page table
+ *     couldn't be copied; the range up to it has been unmapped
+ */
+int unmap_range(pde_t *pgdir, void *va, size_t len)
+{
+    uintptr_t start = ROUNDDOWN((uintptr_t) va, PGSIZE);
+    uintptr_t end = ROUNDUP((uintptr_t) va + len, PGSIZE);
+    struct tlb_gather tg = { .pgdir = pgdir };
+    struct pt_walk w;
+    int r;
+
+    if ((r = pt_unshare_range(pgdir, start, end, &tg)) < 0) {
+        tlb_gather_finish(&tg);
+        return r;
+    }
+
+    pt_walk_init(&w, pgdir, (void *) start, (void *) end);
+    while (pt_walk_next(&w)) {
+        // split huge mappings that stick out and walk their page table
+        if (w.size == PTSIZE && (w.va < start || w.va + PTSIZE > end)) {
+            w.next = MAX(w.va, start);
+            if ((r = page_split(pgdir, (void *) w.next)) < 0)
+                break;
+            continue;
+        }
+
+        if (*w.pte & PTE_P)
+            tlb_gather_add(&tg, w.va, pa2page(PTE_ADDR(*w.pte)));
+        else if (PTE_SWAPPED(*w.pte))
+            swap_free(*w.pte);
+        *w.pte = 0;
+    }
+
+    tlb_gather_finish(&tg);
+    return r;
+}
+
+/*
+ * Sets the permissions of every page mapped in [va, va+len) to 'perm|PTE_P',
+ * keeping the accessed and dirty bits. Like unmap_range, the page tables are
+ * walked once, the TLB is flushed once, and huge mappings that stick out of
+ * the range are split if their permissions change. Missing pages and swap
+ * entries are left alone. Page tables shared after fork are copied first.
+ *
+ * RETURNS:
+ *   0 on success
+ *   -E_NO_MEM, if a huge mapping couldn't be split or a shared page table
+ *     couldn't be copied; the range up to it has been updated
+ */
+int protect_range(pde_t *pgdir, void *va, size_t len, int perm)
+{
+    uintptr_t start = ROUNDDOWN((uintptr_t) va, PGSIZE);
+    uintptr_t end = ROUNDUP((uintptr_t) va + len, PGSIZE);
+    struct tlb_gather tg = { .pgdir = pgdir };
+    struct pt_walk w;
+    int r = 0;
+
+    perm = (perm & PTE_SYSCALL) | PTE_P;
+
+    if ((r = pt_unshare_range(pgdir, start, end, NULL)) < 0)
+        return r;
+
+    pt_walk_init(&w, pgdir, (void *) start, (void *) end);
+    while (pt_walk_next(&w)) {
+        if (!(*w.pte & PTE_P) || (*w.pte & PTE_SYSCALL) == perm)
+            continue;
+
+        // split huge mappings that stick out and walk their page table
+        if (w.size == PTSIZE && (w.va < start || w.va + PTSIZE > end)) {
+            w.next = MAX(w.va, start);
+            if ((r = page_split(pgdir, (void *) w.next)) < 0)
+                break;
+            continue;
+        }
+
+        *w.pte = (*w.pte & ~PTE_SYSCALL) | perm;
+        tlb_gather_add(&tg, w.va, NULL);
+    }
+
+    tlb_gather_finish(&tg);
+    return r;
 }
 
 /*
@@ -788,23 +1957,30 @@ static uintptr_t user_mem_check_addr;
  */
 int user_mem_check(struct env *env, const void *va, size_t len, int perm)
 {
-    for (size_t i = 0; i < ROUNDUP(len, PGSIZE); i += PGSIZE) {
-        size_t addr = (size_t) (i > 0 ?  ROUNDDOWN(va + i, PGSIZE) : va + i);
+    uintptr_t start = (uintptr_t) va, end = start + len;
+    uintptr_t checked = start;      /* [start, checked) is accessible */
+    struct pt_walk w;
 
-        // address must be below ULIM
-        if (addr >= ULIM) {
-            user_mem_check_addr = addr;
-            return -E_FAULT;
-        }
+    perm |= PTE_P;
 
-        // fetch pte
-        pte_t *pte = pgdir_walk(env->env_pgdir, (void *) addr, 0);
+    // address must be below ULIM
+    if (start >= ULIM || end > ULIM || end < start) {
+        user_mem_check_addr = MAX(start, ULIM);
+        return -E_FAULT;
+    }
 
-        // pte must exist and flags must be valid
-        if (!((size_t) *pte & (perm | PTE_P))) {
-            user_mem_check_addr = (size_t) addr;
-            return -E_FAULT;
-        }
+    // every page must be mapped, without holes, and grant the permissions
+    pt_walk_init(&w, env->env_pgdir, (void *) start, (void *) end);
+    while (checked < end && pt_walk_next(&w)) {
+        // a shared page table is read-only at the directory entry
+        if (w.va > checked || (*w.pte & w.pgdir[PDX(w.va)] & perm) != perm)
+            break;
+        checked = w.va + w.size;
+    }
+
+    if (checked < end) {
+        user_mem_check_addr = checked;
+        return -E_FAULT;
     }
 
     // all checks passed; this range can be accessed
@@ -833,7 +2009,64 @@ void user_mem_assert(struct env *env, const void *va, size_t len, int perm)
  ***************************************************************/
 
 /*
- * Check that the pages on the page_free_list are reasonable.
+ * Counts the pages on all buddy free lists and in the per-CPU caches.
+ */
+static size_t count_free_pages(void)
+{
+    size_t nfree = 0;
+
+    for (int zone = 0; zone < NZONES; zone++) {
+        for (unsigned order = 0; order <= MAX_ORDER; order++)
+            nfree += free_area[zone][order].nr_free << order;
+        for (size_t cpu = 0; cpu < NCPU; cpu++)
+            nfree += page_caches[cpu][zone].count;
+    }
+    return nfree + nr_zero;
+}
+
+/*
+ * Takes every free block off the free lists and chains the blocks together
+ * through pp_link, to simulate a no-free-memory situation.
+ */
+static struct page_info *steal_free_pages(void)
+{
+    struct page_info *fl = NULL, *pp;
+
+    page_cache_drain_all();
+    while ((pp = zero_pool_pop())) {
+        pp->pp_order = 0;
+        pp->pp_link = fl;
+        fl = pp;
+    }
+
+    for (int zone = 0; zone < NZONES; zone++) {
+        for (unsigned order = 0; order <= MAX_ORDER; order++) {
+            while ((pp = free_area[zone][order].free_list)) {
+                free_list_remove(pp, order);
+                pp->pp_order = order;
+                pp->pp_link = fl;
+                fl = pp;
+            }
+        }
+    }
+    return fl;
+}
+
+/*
+ * Gives the blocks taken by steal_free_pages back to the free lists.
+ */
+static void return_free_pages(struct page_info *fl)
+{
+    while (fl) {
+        struct page_info *pp = fl;
+        fl = fl->pp_link;
+        pp->pp_link = NULL;
+        buddy_free(pp, pp->pp_order);
+    }
+}
+
+/*
+ * Check that the pages on the buddy free lists are reasonable.
  */
 static void check_page_free_list(bool only_low_memory)
 {
@@ -841,49 +2074,62 @@ static void check_page_free_list(bool only_low_memory)
     unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
     int nfree_basemem = 0, nfree_extmem = 0;
     char *first_free_page;
+    unsigned order;
+    size_t i;
+    int zone;
 
-    if (!page_free_list)
-        panic("'page_free_list' is a null pointer!");
-
-    if (only_low_memory) {
-        /* Move pages with lower addresses first in the free list, since
-         * entry_pgdir does not map all pages. */
-        struct page_info *pp1, *pp2;
-        struct page_info **tp[2] = { &pp1, &pp2 };
-        for (pp = page_free_list; pp; pp = pp->pp_link) {
-            int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-            *tp[pagetype] = pp;
-            tp[pagetype] = &pp->pp_link;
-        }
-        *tp[1] = 0;
-        *tp[0] = pp2;
-        page_free_list = pp1;
-    }
+    if (!count_free_pages())
+        panic("the buddy free lists are empty!");
+
+    /* page_init leaves every list sorted by address, so the low pages that
+     * entry_pgdir maps are handed out first; no reordering is needed. */
 
     /* if there's a page that shouldn't be on the free list,
      * try to make sure it eventually causes trouble. */
-    for (pp = page_free_list; pp; pp = pp->pp_link)
-        if (PDX(page2pa(pp)) < pdx_limit)
-            memset(page2kva(pp), 0x97, 128);
+    for (order = 0; order <= MAX_ORDER; order++)
+        for (pp = free_area[ZONE_NORMAL][order].free_list; pp; pp = pp->pp_link)
+            for (i = 0; i < (1 << order); i++)
+                if (PDX(page2pa(pp + i)) < pdx_limit)
+                    memset(page2kva(pp + i), 0x97, 128);
 
     first_free_page = (char *) boot_alloc(0);
-    for (pp = page_free_list; pp; pp = pp->pp_link) {
-        /* check that we didn't corrupt the free list itself */
-        assert(pp >= pages);
-        assert(pp < pages + npages);
-        assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
-
-        /* check a few pages that shouldn't be on the free list */
-        assert(page2pa(pp) != 0);
-        assert(page2pa(pp) != IOPHYSMEM);
-        assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
-        assert(page2pa(pp) != EXTPHYSMEM);
-        assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
-
-        if (page2pa(pp) < EXTPHYSMEM)
-            ++nfree_basemem;
-        else
-            ++nfree_extmem;
+    for (zone = 0; zone < NZONES; zone++) {
+        for (order = 0; order <= MAX_ORDER; order++) {
+            struct free_area *area = &free_area[zone][order];
+            size_t nblocks = 0;
+
+            for (pp = area->free_list; pp; pp = pp->pp_link) {
+                /* check that we didn't corrupt the free list itself */
+                assert(pp >= pages);
+                assert(pp + (1 << order) <= pages + npages);
+                assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
+                assert((pp - pages) % (1 << order) == 0);
+                assert(pp->flags & PAGE_FREE);
+                assert(pp->pp_order == order);
+                assert(!pp->pp_link || pp->pp_link->pp_prev == pp);
+                assert(page_zone(pp) == zone);
+                assert(page_zone(pp + (1 << order) - 1) == zone);
+                nblocks++;
+
+                for (i = 0; i < (1 << order); i++) {
+                    physaddr_t pa = page2pa(pp + i);
+
+                    /* check a few pages that shouldn't be on the free list */
+                    assert(pa != 0);
+                    assert(pa != IOPHYSMEM);
+                    assert(pa != EXTPHYSMEM - PGSIZE);
+                    assert(pa != EXTPHYSMEM);
+                    assert(pa < EXTPHYSMEM || pa >= PADDR(first_free_page));
+                    assert(pp[i].pp_ref == 0);
+
+                    if (pa < EXTPHYSMEM)
+                        ++nfree_basemem;
+                    else
+                        ++nfree_extmem;
+                }
+            }
+            assert(nblocks == area->nr_free);
+        }
     }
 
     assert(nfree_basemem > 0);
@@ -907,8 +2153,7 @@ static void check_page_alloc(void)
         panic("'pages' is a null pointer!");
 
     /* check number of free pages */
-    for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-        ++nfree;
+    nfree = count_free_pages();
     total_free = nfree;
 
     /* should be able to allocate three pages */
@@ -929,8 +2174,7 @@ static void check_page_alloc(void)
      * Lab 1 Bonus:
      * For the bonus, if you go for a different design for the page allocator,
      * then do update here suitably to simulate a no-free-memory situation */
-    fl = page_free_list;
-    page_free_list = 0;
+    fl = steal_free_pages();
 
     /* should be no free memory */
     assert(!page_alloc(0));
@@ -958,7 +2202,7 @@ static void check_page_alloc(void)
         assert(c[i] == 0);
 
     /* give free list back */
-    page_free_list = fl;
+    return_free_pages(fl);
 
     /* free the pages we took */
     page_free(pp0);
@@ -966,8 +2210,7 @@ static void check_page_alloc(void)
     page_free(pp2);
 
     /* number of free pages should be the same */
-    for (pp = page_free_list; pp; pp = pp->pp_link)
-        --nfree;
+    nfree -= count_free_pages();
     assert(nfree == 0);
 
     cprintf("[4K] check_page_alloc() succeeded!\n");
@@ -1005,11 +2248,28 @@ static void check_page_alloc(void)
     page_free(php1);
 
     /* number of free pages should be the same */
-    nfree = total_free;
-    for (pp = page_free_list; pp; pp = pp->pp_link)
-        --nfree;
+    nfree = total_free - count_free_pages();
     assert(nfree == 0);
 
+    /* freed huge pages coalesce, so a huge page is available again */
+    assert((php0 = page_alloc(ALLOC_HUGE)));
+    assert(php0->pp_order == MAX_ORDER && (php0->flags & ALLOC_HUGE));
+    page_free(php0);
+
+    /* the statistics page agrees with the free lists */
+    page_stats_update();
+    assert(page_stats->nfree == count_free_pages());
+    assert(page_stats->frag_index[0] == 0);
+    assert(page_stats->frag_index[MAX_ORDER] < 1000);
+    assert(page_stats->failures >= 2);
+    assert(page_stats->flag_allocs[PSTAT_HUGE] >= 4);
+
+    /* intermediate orders come out aligned to their own size */
+    assert((pp0 = page_alloc_order(3, 0)));
+    assert((pp0 - pages) % 8 == 0);
+    page_free(pp0);
+    assert(count_free_pages() == total_free);
+
     cprintf("[4M] check_page_alloc() succeeded!\n");
 }
 
@@ -1032,13 +2292,18 @@ static void check_kern_pgdir(void)
     for (i = 0; i < n; i += PGSIZE)
         assert(check_va2pa(pgdir, UPAGES + i) == PADDR(pages) + i);
 
+    /* check allocator statistics page */
+    assert(check_va2pa(pgdir, UPSTATS) == PADDR(page_stats));
+    assert(ROUNDUP(npages*sizeof(struct page_info), PGSIZE)
+           <= UPSTATS - UPAGES);
+
     /* check envs array (new test for lab 3) */
     n = ROUNDUP(NENV*sizeof(struct env), PGSIZE);
     for (i = 0; i < n; i += PGSIZE)
         assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
 
     /* check phys mem */
-    for (i = 0; i < npages * PGSIZE; i += PGSIZE)
+    for (i = 0; i < npages_lowmem * PGSIZE; i += PGSIZE)
         assert(check_va2pa(pgdir, KERNBASE + i) == i);
 
     /* check kernel stack */
@@ -1046,6 +2311,10 @@ static void check_kern_pgdir(void)
         assert(check_va2pa(pgdir, KSTACKTOP - KSTKSIZE + i) == PADDR(bootstack) + i);
     assert(check_va2pa(pgdir, KSTACKTOP - PTSIZE) == ~0);
 
+    /* check kmap windows start out empty */
+    for (i = 0; i < KMAPSIZE; i += PGSIZE)
+        assert(check_va2pa(pgdir, KMAPBASE + i) == ~0);
+
     /* check PDE permissions */
     for (i = 0; i < NPDENTRIES; i++) {
         switch (i) {
@@ -1060,6 +2329,8 @@ static void check_kern_pgdir(void)
             if (i >= PDX(KERNBASE)) {
                 assert(pgdir[i] & PTE_P);
                 assert(pgdir[i] & PTE_W);
+                assert(pgdir[i] & PTE_PS);
+                assert(pgdir[i] & PTE_G);
             } else
                 assert(pgdir[i] == 0);
             break;
@@ -1081,6 +2352,8 @@ static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va)
     pgdir = &pgdir[PDX(va)];
     if (!(*pgdir & PTE_P))
         return ~0;
+    if (*pgdir & PTE_PS)
+        return PTE_ADDR(*pgdir) | (PTX(va) << PTXSHIFT);
     p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
     if (!(p[PTX(va)] & PTE_P))
         return ~0;
@@ -1115,8 +2388,7 @@ static void check_page(void)
      * For the bonus, if you had chosen a different design for
      * the page allocator, then do update here suitably to
      * simulate a no-free-memory situation */
-    fl = page_free_list;
-    page_free_list = 0;
+    fl = steal_free_pages();
 
     /* should be no free memory */
     assert(!page_alloc(0));
@@ -1235,7 +2507,7 @@ static void check_page(void)
     pp0->pp_ref = 0;
 
     /* give free list back */
-    page_free_list = fl;
+    return_free_pages(fl);
 
     /* free the pages we took */
     page_free(pp0);
@@ -1275,6 +2547,7 @@ static void check_page_installed_pgdir(void)
     struct page_info *fl;
     pte_t *ptep, *ptep1;
     uintptr_t va;
+    char *c1, *c2;
     int i;
 
     /* check that we can read and write installed pages */
@@ -1306,6 +2579,24 @@ static void check_page_installed_pgdir(void)
     /* free the pages we took */
     page_free(pp0);
 
+    /* check that high memory pages are reachable through kmap */
+    assert((pp1 = page_alloc(ALLOC_HIGHMEM | ALLOC_ZERO)));
+    assert((pp2 = page_alloc(ALLOC_HIGHMEM)));
+    if (npages > npages_lowmem)
+        assert(page_zone(pp1) == ZONE_HIGHMEM && page_zone(pp2) == ZONE_HIGHMEM);
+    c1 = kmap(pp1);
+    c2 = kmap(pp2);
+    assert(c1 != c2);
+    for (i = 0; i < PGSIZE; i++)
+        assert(c1[i] == 0);
+    memset(c2, 4, PGSIZE);
+    kunmap(c2);
+    kunmap(c1);
+    page_insert(kern_pgdir, pp2, (void*) PGSIZE, PTE_W);
+    assert(*(uint32_t *)PGSIZE == 0x04040404U);
+    page_remove(kern_pgdir, (void*) PGSIZE);
+    page_free(pp1);
+
     cprintf("check_page_installed_pgdir() succeeded!\n");
 }
 
@@ -1313,6 +2604,7 @@ static void check_page_installed_pgdir(void)
 static void check_page_hugepages(void)
 {
     struct page_info *php0;
+    int i;
     assert(php0 = page_alloc(ALLOC_HUGE));
     assert(page_insert(kern_pgdir, php0, (void *)(1024*PGSIZE), PTE_W | PTE_PS) == 0);
     assert(php0->pp_ref == 1);
@@ -1355,5 +2647,125 @@ static void check_page_hugepages(void)
     page_remove(kern_pgdir, (void*) (2*1024*PGSIZE));
     assert(php0->pp_ref == 0);
 
+    /* check page_lookup() and page_split() inside a huge mapping */
+    size_t nfree = count_free_pages();
+    struct page_info *pp;
+    assert(php0 = page_alloc(ALLOC_HUGE));
+    assert(page_insert(kern_pgdir, php0, (void *)(1024*PGSIZE), PTE_W | PTE_PS) == 0);
+    *(uint32_t *)(1030*PGSIZE) = 0x43434343U;
+    assert(page_lookup(kern_pgdir, (void *)(1030*PGSIZE), &p_pte1) == php0 + 6);
+    assert(page_head(php0 + 6) == php0);
+    assert(page_split(kern_pgdir, (void *)(1030*PGSIZE)) == 0);
+    p_pte1 = pgdir_walk(kern_pgdir, (void*)(1030*PGSIZE), 0);
+    assert(p_pte1 && !(*p_pte1 & PTE_PS) && (*p_pte1 & PTE_W));
+    assert(PTE_ADDR(*p_pte1) == page2pa(php0 + 6));
+    assert(*(uint32_t *)(1030*PGSIZE) == 0x43434343U);
+    assert(php0->pp_ref == 1024);
+    assert(page_private(kern_pgdir, php0 + 6, (void *)(1030*PGSIZE)));
+
+    /* 4K pages of a split huge page are unmapped one by one */
+    page_remove(kern_pgdir, (void*)(1030*PGSIZE));
+    assert(php0->pp_ref == 1023 && !page_lookup(kern_pgdir, (void*)(1030*PGSIZE), 0));
+    assert(page_private(kern_pgdir, php0 + 7, (void *)(1031*PGSIZE)));
+    php0->pp_ref++;
+    assert(!page_private(kern_pgdir, php0 + 7, (void *)(1031*PGSIZE)));
+    php0->pp_ref--;
+    for (i = 0; i < 1024; i++)
+        page_remove(kern_pgdir, (void*)((1024 + i)*PGSIZE));
+    pp = pa2page(PTE_ADDR(kern_pgdir[1]));
+    kern_pgdir[1] = 0;
+    page_decref(pp);
+    assert(count_free_pages() == nfree);
+
+    /* range operations keep a huge mapping they cover whole and split one
+     * that sticks out of the range */
+    assert(php0 = page_alloc(ALLOC_HUGE));
+    assert(page_insert(kern_pgdir, php0, (void *)(1024*PGSIZE), PTE_W | PTE_PS) == 0);
+    assert(protect_range(kern_pgdir, (void *)(1024*PGSIZE), PTSIZE, 0) == 0);
+    assert((kern_pgdir[1] & PTE_PS) && !(kern_pgdir[1] & PTE_W));
+    assert(unmap_range(kern_pgdir, (void *)(1030*PGSIZE), 2*PGSIZE) == 0);
+    assert(!(kern_pgdir[1] & PTE_PS) && php0->pp_ref == 1022);
+    assert(!page_lookup(kern_pgdir, (void*)(1031*PGSIZE), 0));
+    assert(page_lookup(kern_pgdir, (void*)(1032*PGSIZE), &p_pte1) == php0 + 8);
+    assert(!(*p_pte1 & PTE_W));
+    assert(unmap_range(kern_pgdir, (void *)(1024*PGSIZE), PTSIZE) == 0);
+    assert(!page_lookup(kern_pgdir, (void*)(1032*PGSIZE), 0));
+    pp = pa2page(PTE_ADDR(kern_pgdir[1]));
+    kern_pgdir[1] = 0;
+    page_decref(pp);
+    assert(count_free_pages() == nfree);
+
+    /* a huge page is refused where a page table maps 4K pages already */
+    assert(pp = page_alloc(0));
+    assert(page_insert(kern_pgdir, pp, (void *)(1024*PGSIZE), PTE_W) == 0);
+    assert(php0 = page_alloc(ALLOC_HUGE));
+    assert(page_insert(kern_pgdir, php0, (void *)(1024*PGSIZE), PTE_W | PTE_PS) == -E_INVAL);
+    assert(php0->pp_ref == 0 && page_lookup(kern_pgdir, (void *)(1024*PGSIZE), 0) == pp);
+    page_free(php0);
+    page_remove(kern_pgdir, (void *)(1024*PGSIZE));
+    pp = pa2page(PTE_ADDR(kern_pgdir[1]));
+    kern_pgdir[1] = 0;
+    page_decref(pp);
+    assert(count_free_pages() == nfree);
+
     cprintf("check_page_hugepages() succeeded!\n");
 }
+
+static void check_pt_share(void)
+{
+    struct page_info *pp0, *pp1, *pp2, *pt;
+    pde_t *pd1, *pd2;
+    pte_t *ptep;
+    size_t nfree = count_free_pages();
+    void *va = (void *) PTSIZE;
+
+    assert((pp0 = page_alloc(ALLOC_ZERO)));
+    assert((pp1 = page_alloc(ALLOC_ZERO)));
+    assert((pp2 = page_alloc(0)));
+    pd1 = page2kva(pp0);
+    pd2 = page2kva(pp1);
+
+    /* fork shares the page table read-only at the PDE */
+    assert(page_insert(pd1, pp2, va, PTE_W | PTE_U) == 0);
+    pt = pa2page(PTE_ADDR(pd1[PDX(va)]));
+    pt_share(pd2, pd1);
+    assert(pd1[PDX(va)] == pd2[PDX(va)]);
+    assert((pd1[PDX(va)] & PDE_COW) && !(pd1[PDX(va)] & PTE_W));
+    assert(pt->pp_ref == 2 && pp2->pp_ref == 1);
+    assert(page_lookup(pd2, va, &ptep) == pp2 && (*ptep & PTE_W));
+
+    /* a change gives the writer its own copy; the page becomes
+     * copy-on-write in both */
+    assert(page_insert(pd2, pp2, va + PGSIZE, PTE_U) == 0);
+    assert(PTE_ADDR(pd2[PDX(va)]) != page2pa(pt));
+    assert(!(pd2[PDX(va)] & PDE_COW) && (pd2[PDX(va)] & PTE_W));
+    assert(pt->pp_ref == 1 && pp2->pp_ref == 3);
+    assert(page_lookup(pd1, va, &ptep) == pp2 && !(*ptep & PTE_W));
+    assert(!page_lookup(pd1, va + PGSIZE, 0));
+
+    /* the last user keeps the page table */
+    assert(pt_unshare(pd1, va) == 0);
+    assert(PTE_ADDR(pd1[PDX(va)]) == page2pa(pt) && pt->pp_ref == 1);
+    assert(!(pd1[PDX(va)] & PDE_COW) && (pd1[PDX(va)] & PTE_W));
+
+    assert(unmap_range(pd2, va, PTSIZE) == 0);
+    assert(pp2->pp_ref == 1);
+    page_decref(pa2page(PTE_ADDR(pd2[PDX(va)])));
+    pd2[PDX(va)] = 0;
+
+    /* unmapping a shared page table as a whole just drops it */
+    pt_share(pd2, pd1);
+    assert(pt->pp_ref == 2 && pp2->pp_ref == 1);
+    assert(unmap_range(pd2, va, PTSIZE) == 0);
+    assert(!pd2[PDX(va)] && pt->pp_ref == 1 && pp2->pp_ref == 1);
+
+    assert(unmap_range(pd1, va, PTSIZE) == 0);
+    assert(!page_lookup(pd1, va, 0));
+    pd1[PDX(va)] = 0;
+    page_decref(pt);
+    page_free(pp1);
+    page_free(pp0);
+    assert(count_free_pages() == nfree);
+
+    cprintf("check_pt_share() succeeded!\n");
+}
@@ -8,6 +8,7 @@
 
 #include <inc/memlayout.h>
 #include <inc/assert.h>
+#include <kern/cpu.h>
 
 struct env;
 
@@ -15,13 +16,16 @@ extern char bootstacktop[], bootstack[];
 
 extern struct page_info *pages;
 extern size_t npages;
+extern size_t npages_lowmem;
 
 extern pde_t *kern_pgdir;
 
+extern struct page_stats *page_stats;
+
 
 /*
  * This macro takes a kernel virtual address -- an address that points above
- * KERNBASE, where the machine's maximum 256MB of physical memory is mapped --
+ * KERNBASE, where the first 256MB of physical memory are mapped --
  * and returns the corresponding physical address.  It panics if you pass it a
  * non-kernel virtual address.
  */
@@ -35,12 +39,13 @@ static inline physaddr_t _paddr(const char *file, int line, void *kva)
 }
 
 /* This macro takes a physical address and returns the corresponding kernel
- * virtual address.  It panics if you pass an invalid physical address. */
+ * virtual address.  It panics if you pass an invalid physical address or one
+ * in high memory, which has no permanent kernel mapping (see kmap). */
 #define KADDR(pa) _kaddr(__FILE__, __LINE__, pa)
 
 static inline void *_kaddr(const char *file, int line, physaddr_t pa)
 {
-    if (PGNUM(pa) >= npages)
+    if (PGNUM(pa) >= npages_lowmem)
         _panic(file, line, "KADDR called with invalid pa %08lx", pa);
     return (void *)(pa + KERNBASE);
 }
@@ -51,6 +56,95 @@ enum {
     ALLOC_ZERO = 1<<0,
     ALLOC_HUGE = 1<<1,
     ALLOC_PREMAPPED = 1<<2,
+    /* Prefer a page above the direct map; only for pages accessed through
+     * user mappings or kmap. */
+    ALLOC_HIGHMEM = 1<<3,
+    /* Fail instead of reclaiming user pages when memory runs out; for
+     * speculative allocations such as fault-around. */
+    ALLOC_NORECLAIM = 1<<4,
+};
+
+/*
+ * Physical memory zones. Pages below 4GB - KERNBASE are direct-mapped at
+ * KERNBASE, pages above that are high memory and can only be reached by the
+ * kernel through kmap. The boundary is aligned to a huge page, so no buddy
+ * block ever spans both zones.
+ */
+enum {
+    ZONE_NORMAL,
+    ZONE_HIGHMEM,
+    NZONES,
+};
+
+#define KMAPSIZE    (NCPU * KMAP_SLOTS * PGSIZE)
+
+/* Page flags stored in struct page_info's flags field. ALLOC_HUGE is also
+ * stored there to mark the first page of an allocated huge page. */
+enum {
+    /* Page heads a block that is on one of the buddy free lists */
+    PAGE_FREE = 1<<7,
+    /* Page sits in a per-CPU page cache */
+    PAGE_CACHED = 1<<6,
+    /* Page sits in the pool of pre-zeroed pages */
+    PAGE_ZEROED = 1<<5,
+    /* Page is part of an allocated huge page but not its first page; its
+     * references are counted on the first page */
+    PAGE_TAIL = 1<<4,
+    /* Page is held by the binary page cache, see kern/bincache.h */
+    PAGE_BINCACHE = 1<<3,
+};
+
+/*
+ * Per-CPU cache of free order-0 pages in front of the buddy allocator. The
+ * common 4K page_alloc/page_free only touches the cache of the local CPU;
+ * the shared buddy lists are only used to refill or drain it in batches.
+ */
+#define PCP_HIGH    64      /* max pages held in one CPU's cache */
+#define PCP_BATCH   16      /* pages moved per refill or drain */
+
+struct page_cache {
+    struct page_info *pages[PCP_HIGH];  /* LIFO stack, hottest page on top */
+    size_t count;
+
+    /* statistics */
+    uint32_t alloc_hits;    /* page_alloc served from the cache */
+    uint32_t alloc_misses;  /* page_alloc found the cache empty */
+    uint32_t free_hits;     /* page_free kept the page in the cache */
+    uint32_t refills;       /* batches taken from the buddy allocator */
+    uint32_t drains;        /* batches given back to the buddy allocator */
+};
+
+extern struct page_cache page_caches[NCPU][NZONES];
+
+/*
+ * Pool of pre-zeroed free pages, filled by a kernel thread whenever the CPU
+ * would otherwise be idle. ALLOC_ZERO requests for single pages are served
+ * from it without a memset. The pool only holds low memory pages.
+ */
+#define ZERO_POOL_HIGH  256     /* stop zeroing at this many pages */
+#define ZERO_POOL_LOW   64      /* wake the zeroing thread below this */
+#define ZERO_BATCH      8       /* pages zeroed between two yields */
+
+/*
+ * Range operations flush the TLB page by page up to TLB_FLUSH_MAX pages and
+ * reload CR3 above that. Released pages are freed in batches of
+ * TLB_GATHER_PAGES, each after its flush.
+ */
+#define TLB_FLUSH_MAX       32
+#define TLB_GATHER_PAGES    64
+
+/*
+ * Walk over the used entries of a range of a page directory, see
+ * pt_walk_next. The walk may be moved back by lowering 'next', e.g. to revisit
+ * a huge mapping that was just split.
+ */
+struct pt_walk {
+    pde_t *pgdir;
+    uintptr_t next;     /* where the walk continues */
+    uintptr_t end;      /* end of the range */
+    uintptr_t va;       /* address mapped by the current entry */
+    pte_t *pte;         /* the current PTE, or the PDE of a huge mapping */
+    size_t size;        /* bytes mapped by the current entry */
 };
 
 enum {
@@ -63,13 +157,40 @@ void mem_init(void);
 
 void page_init(void);
 struct page_info *page_alloc(int alloc_flags);
+struct page_info *page_alloc_order(unsigned order, int alloc_flags);
 void page_free(struct page_info *pp);
+void page_cache_drain_all(void);
+void page_zero_init(void);
+size_t page_free_count(void);
+void page_stats_update(void);
+void *kmap(struct page_info *pp);
+void kunmap(void *kva);
 int page_insert(pde_t *pgdir, struct page_info *pp, void *va, int perm);
-void page_remove(pde_t *pgdir, void *va);
+int page_remove(pde_t *pgdir, void *va);
 struct page_info *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void page_decref(struct page_info *pp);
+int page_split(pde_t *pgdir, void *va);
+bool page_private(pde_t *pgdir, struct page_info *pp, void *va);
+
+/*
+ * Software PDE bit: after fork, the page table is shared by several page
+ * directories and write-protected in all of them. The first change to its
+ * entries through one of them copies it; see pt_share and pt_unshare.
+ */
+#define PDE_COW             0x400
+
+void pt_share(pde_t *dst, pde_t *src);
+int pt_unshare(pde_t *pgdir, const void *va);
+void pt_walk_init(struct pt_walk *w, pde_t *pgdir, void *start, void *end);
+bool pt_walk_next(struct pt_walk *w);
+int unmap_range(pde_t *pgdir, void *va, size_t len);
+int protect_range(pde_t *pgdir, void *va, size_t len, int perm);
 
+void load_pgdir(pde_t *pgdir);
 void tlb_invalidate(pde_t *pgdir, void *va);
+void tlb_flush(pde_t *pgdir);
+void tlb_shootdown(pde_t *pgdir, const uintptr_t *va, size_t n);
+void tlb_shootdown_handler(void);
 
 void *mmio_map_region(physaddr_t pa, size_t size);
 
@@ -88,6 +209,20 @@ static inline struct page_info *pa2page(physaddr_t pa)
     return &pages[PGNUM(pa)];
 }
 
+static inline int page_zone(struct page_info *pp)
+{
+    return (size_t) (pp - pages) < npages_lowmem ? ZONE_NORMAL : ZONE_HIGHMEM;
+}
+
+/* Returns the page that holds the reference count for 'pp': the first page of
+ * the huge page 'pp' belongs to, or 'pp' itself. */
+static inline struct page_info *page_head(struct page_info *pp)
+{
+    if (pp->flags & PAGE_TAIL)
+        return &pages[(pp - pages) & ~((1 << MAX_ORDER) - 1)];
+    return pp;
+}
+
 static inline void *page2kva(struct page_info *pp)
 {
     return KADDR(page2pa(pp));
@@ -0,0 +1,133 @@
+/*
+ * Clock-based reclaim of user pages: clean binary-backed pages are dropped,
+ * anonymous pages are swapped out.
+ */
+
+#include <inc/mmu.h>
+
+#include <kern/reclaim.h>
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/vma.h>
+#include <kern/swap.h>
+#include <kern/bincache.h>
+
+/* Position of the clock hand: the next page to look at is the first page at or
+ * above 'va' that lies in a VMA of envs[env]. */
+static struct {
+    size_t env;
+    uintptr_t va;
+} hand;
+
+/*
+ * Moves the hand to the first page of the next environment.
+ * Returns true when the hand wrapped around to the first environment.
+ */
+static bool hand_next_env(void)
+{
+    hand.va = 0;
+    hand.env = (hand.env + 1) % NENV;
+    return hand.env == 0;
+}
+
+/*
+ * Looks at the page mapped at 'va' of VMA 'v' in 'e'.
+ * Returns true if it was reclaimed.
+ */
+static bool reclaim_page(struct env *e, struct vma *v, void *va)
+{
+    pte_t *pte;
+    struct page_info *pp = page_lookup(e->env_pgdir, va, &pte);
+
+    if (!pp || (*pte & PTE_PS))
+        return false;
+
+    // a page table shared after fork would have to be copied first, which
+    // takes memory rather than freeing it
+    if (e->env_pgdir[PDX(va)] & PDE_COW)
+        return false;
+
+    // recently used: clear the accessed bit and give it a second chance
+    if (*pte & PTE_A) {
+        *pte &= ~PTE_A;
+        tlb_invalidate(e->env_pgdir, va);
+        return false;
+    }
+
+    // anonymous pages only exist in memory; write them to swap
+    if (v->type == VMA_ANON)
+        return swap_out(e->env_pgdir, va);
+
+    // written pages differ from the image or disk; shared pages would need to be
+    // unmapped from every environment. The binary page cache's reference
+    // does not count, but the page is only freed by bincache_shrink.
+    bool cached = pp->flags & PAGE_BINCACHE;
+    if ((*pte & PTE_D) || page_head(pp)->pp_ref != 1 + cached)
+        return false;
+
+    if (page_remove(e->env_pgdir, va) < 0)
+        return false;
+    return !cached;
+}
+
+/*
+ * Returns whether the pages of 'v' may be reclaimed. Shared memory is mapped
+ * by several environments under one key and stays resident.
+ */
+static bool reclaimable(struct vma *v)
+{
+    if (v->type == VMA_BINARY || v->type == VMA_DISK)
+        return true;
+#ifdef BONUS_LAB5
+    if (v->shmem_key)
+        return false;
+#endif
+    return v->type == VMA_ANON && swap_enabled();
+}
+
+/*
+ * Frees up to 'target' clean binary or swapped out anonymous pages. Gives up after the hand has swept
+ * all environments twice, so every page had its second chance.
+ * Returns the number of pages freed.
+ */
+size_t page_reclaim(size_t target)
+{
+    // cached binary pages that no environment maps go first, then page
+    // directories kept for new environments
+    size_t freed = bincache_shrink(target);
+    freed += pgdir_pool_shrink(target - freed);
+    int wraps = 0;
+
+    while (freed < target && wraps < 2) {
+        struct env *e = &envs[hand.env];
+
+        // environments without VMAs have nothing to reclaim
+        if (e->env_status == ENV_FREE || !e->env_vmas) {
+            wraps += hand_next_env();
+            continue;
+        }
+
+        struct vma *v = vma_find_from(e, (void *) hand.va);
+        if (!v) {
+            wraps += hand_next_env();
+            continue;
+        }
+        if (!reclaimable(v)) {
+            hand.va = (uintptr_t) v->va + v->len;
+            continue;
+        }
+
+        if (hand.va < (uintptr_t) v->va)
+            hand.va = ROUNDDOWN((uintptr_t) v->va, PGSIZE);
+
+        if (reclaim_page(e, v, (void *) hand.va))
+            freed++;
+        hand.va += PGSIZE;
+    }
+
+    // shared binary pages the sweep unmapped from their last environment
+    if (freed < target)
+        freed += bincache_shrink(target - freed);
+
+    return freed;
+}
@@ -0,0 +1,26 @@
+#ifndef JOS_KERN_RECLAIM_H
+#define JOS_KERN_RECLAIM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+/*
+ * Reclaim of user pages.
+ *
+ * A page of a VMA_BINARY region that was never written still holds what the
+ * ELF image holds, so it can be dropped and read back from the image by the
+ * page fault handler. A page of a private VMA_ANON region can be written to
+ * swap (see kern/swap.h). When page_alloc runs out of memory it calls
+ * page_reclaim, which sweeps a clock hand over the binary and anonymous VMAs
+ * of all environments: pages with the accessed bit set get a second chance,
+ * clean binary pages and anonymous pages mapped by a single environment are
+ * freed. Read-only binary pages in the binary page cache (kern/bincache.h) are
+ * unmapped the same way and freed once no environment maps them any more.
+ */
+#define RECLAIM_BATCH   32      /* pages page_alloc tries to reclaim at once */
+
+size_t page_reclaim(size_t target);
+
+#endif /* !JOS_KERN_RECLAIM_H */
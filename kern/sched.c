@@ -7,8 +7,20 @@
 
 static uint64_t last_tsc = 0;
 
+/* Kernel thread that only runs when no environment is runnable */
+static struct env *idle_env = NULL;
+
 void sched_halt(void);
 
+/*
+ * Registers 'e' as the idle thread. It is skipped by the round-robin search
+ * and only picked, while it is runnable, instead of halting the CPU.
+ */
+void sched_set_idle(struct env *e)
+{
+    idle_env = e;
+}
+
 /*
  * Choose a user environment to run and run it.
  */
@@ -45,6 +57,8 @@ void sched_yield(bool force)
         }
         for(size_t i = 0; i < NENV; ++i) {
             current = &envs[(start_index + i) % NENV];
+            if (current == idle_env)
+                continue;
             if (current->env_status == ENV_RUNNABLE) {
                 if(current->env_wait_env >= 0) {
                     struct env *wait; 
@@ -91,14 +105,16 @@ void sched_yield(bool force)
             env_run(curenv);
         }
 
-        struct env *next = &envs[ENVX(curenv->env_id) + 1];
-        if(next->env_status == ENV_RUNNABLE && next->env_wait_env < 0) {
+        struct env *next = &envs[(ENVX(curenv->env_id) + 1) % NENV];
+        if(next != idle_env && next->env_status == ENV_RUNNABLE && next->env_wait_env < 0) {
             env_run(next);
         } else {
-            //next = NULL;
+            next = NULL;
             for(size_t i = 0; i < NENV; ++i) {
                 //cprintf("checking %d with type %d\n", (i + ENVX(curenv->env_id) + 1) % NENV, envs[(i + ENVX(curenv->env_id) + 1) % NENV].env_status);
                 current = &envs[(i + ENVX(curenv->env_id) + 1) % NENV];
+                if (current == idle_env)
+                    continue;
                 if (current->env_status == ENV_RUNNABLE) {
                     if(current->env_wait_env >= 0) {
                         struct env *wait; 
@@ -129,6 +145,10 @@ void sched_yield(bool force)
         //cprintf("Running next env %d with status: %d\n", ENVX(next->env_id), next->env_status);
     }
 
+    /* Nothing else to do: give the idle thread the CPU if it has work */
+    if (idle_env && idle_env->env_status == ENV_RUNNABLE)
+        env_run(idle_env);
+
     cprintf("Schedule halt\n");
     /* sched_halt never returns */
     sched_halt();
@@ -145,6 +165,8 @@ void sched_halt(void)
     /* For debugging and testing purposes, if there are no runnable
      * environments in the system, then drop into the kernel monitor. */
     for (i = 0; i < NENV; i++) {
+        if (&envs[i] == idle_env)
+            continue;
         if ((envs[i].env_status == ENV_RUNNABLE ||
              envs[i].env_status == ENV_RUNNING ||
              envs[i].env_status == ENV_DYING))
@@ -158,7 +180,7 @@ void sched_halt(void)
 
     /* Mark that no environment is running on this CPU */
     curenv = NULL;
-    lcr3(PADDR(kern_pgdir));
+    load_pgdir(kern_pgdir);
 
     /* Mark that this CPU is in the HALT state, so that when
      * timer interupts come in, we know we should re-acquire the
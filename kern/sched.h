@@ -6,7 +6,10 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+struct env;
+
 /* This function does not return. */
 void sched_yield(bool force) __attribute__((noreturn));
+void sched_set_idle(struct env *e);
 
 #endif  /* !JOS_KERN_SCHED_H */
@@ -0,0 +1,188 @@
+/*
+ * Swap area for anonymous user pages on the second IDE disk.
+ */
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/stdio.h>
+
+#include <kern/swap.h>
+#include <kern/ide.h>
+#include <kern/pmap.h>
+#include <kern/spinlock.h>
+
+static bool swap_present;
+
+/* Number of swap entries referring to each slot; 0 means the slot is free */
+static uint16_t swap_count[SWAP_SLOTS];
+/* Where the search for a free slot starts */
+static size_t swap_hint;
+
+static uint32_t nr_used;
+static uint32_t nr_outs;
+static uint32_t nr_ins;
+
+/* Protects the slot counts and statistics above */
+static struct spinlock swap_lock = {
+#ifdef DEBUG_SPINLOCK
+    .name = "swap_lock"
+#endif
+};
+
+void swap_init(void)
+{
+    swap_present = ide_probe_disk(SWAP_DISK);
+    if (swap_present)
+        cprintf("swap: %u slots on disk %d\n", SWAP_SLOTS, SWAP_DISK);
+    else
+        cprintf("swap: no disk %d, swapping disabled\n", SWAP_DISK);
+}
+
+bool swap_enabled(void)
+{
+    return swap_present;
+}
+
+/*
+ * Takes a free slot. Returns its number, or -1 if the swap area is full.
+ */
+static int slot_alloc(void)
+{
+    int slot = -1;
+
+    spin_lock(&swap_lock);
+    for (size_t i = 0; i < SWAP_SLOTS; i++) {
+        size_t s = (swap_hint + i) % SWAP_SLOTS;
+        if (!swap_count[s]) {
+            swap_count[s] = 1;
+            swap_hint = s + 1;
+            nr_used++;
+            slot = s;
+            break;
+        }
+    }
+    spin_unlock(&swap_lock);
+
+    return slot;
+}
+
+/*
+ * Writes the page mapped at 'va' to a free slot, frees it and replaces its
+ * PTE with a swap entry. Only 4K pages mapped by a single PTE are swapped.
+ * Returns true if the page was swapped out.
+ */
+bool swap_out(pde_t *pgdir, void *va)
+{
+    pte_t *pte;
+    struct page_info *pp;
+    char *kva;
+    int slot, r;
+
+    if (!swap_present)
+        return false;
+
+    pp = page_lookup(pgdir, va, &pte);
+    if (!pp || (*pte & PTE_PS) || pp->pp_ref != 1)
+        return false;
+
+    if ((slot = slot_alloc()) < 0)
+        return false;
+
+    kva = kmap(pp);
+    r = ide_write(SWAP_DISK, slot * SECTPERPAGE, kva, SECTPERPAGE);
+    kunmap(kva);
+    if (r < 0) {
+        swap_free((pte_t) slot << PTXSHIFT);
+        return false;
+    }
+
+    page_decref(pp);
+    *pte = ((pte_t) slot << PTXSHIFT) | PTE_SWAP;
+    tlb_invalidate(pgdir, va);
+
+    spin_lock(&swap_lock);
+    nr_outs++;
+    spin_unlock(&swap_lock);
+    return true;
+}
+
+/*
+ * Reads the page whose swap entry is at 'va' back into a new page and maps
+ * it there with 'perm'. The page is private to 'pgdir' afterwards, even if
+ * the slot was shared.
+ * Returns 0 on success, -E_NO_MEM if memory ran out or the read failed.
+ */
+int swap_in(pde_t *pgdir, void *va, int perm)
+{
+    pte_t *pte = pgdir_walk(pgdir, va, 0);
+    struct page_info *pp;
+    pte_t entry;
+    char *kva;
+    int r;
+
+    assert(pte && PTE_SWAPPED(*pte));
+    entry = *pte;
+
+    pp = page_alloc(ALLOC_HIGHMEM);
+    if (!pp)
+        return -E_NO_MEM;
+
+    kva = kmap(pp);
+    r = ide_read(SWAP_DISK, PTE_SLOT(entry) * SECTPERPAGE, kva, SECTPERPAGE);
+    kunmap(kva);
+
+    // page_alloc may have swapped out other pages, never this entry
+    if (r < 0 || page_insert(pgdir, pp, ROUNDDOWN(va, PGSIZE), perm) < 0) {
+        page_free(pp);
+        return -E_NO_MEM;
+    }
+
+    swap_free(entry);
+
+    spin_lock(&swap_lock);
+    nr_ins++;
+    spin_unlock(&swap_lock);
+    return 0;
+}
+
+/*
+ * Adds a reference to the slot of swap entry 'pte', for a copy of the entry.
+ */
+void swap_dup(pte_t pte)
+{
+    size_t slot = PTE_SLOT(pte);
+
+    assert(slot < SWAP_SLOTS);
+    spin_lock(&swap_lock);
+    assert(swap_count[slot] > 0 && swap_count[slot] < (uint16_t) ~0);
+    swap_count[slot]++;
+    spin_unlock(&swap_lock);
+}
+
+/*
+ * Drops a reference to the slot of swap entry 'pte'.
+ */
+void swap_free(pte_t pte)
+{
+    size_t slot = PTE_SLOT(pte);
+
+    assert(slot < SWAP_SLOTS);
+    spin_lock(&swap_lock);
+    assert(swap_count[slot] > 0);
+    if (--swap_count[slot] == 0)
+        nr_used--;
+    spin_unlock(&swap_lock);
+}
+
+/*
+ * Fills in the swap fields of a statistics snapshot.
+ */
+void swap_stats(struct page_stats *st)
+{
+    spin_lock(&swap_lock);
+    st->swap_slots = swap_present ? SWAP_SLOTS : 0;
+    st->swap_used = nr_used;
+    st->swapped_out = nr_outs;
+    st->swapped_in = nr_ins;
+    spin_unlock(&swap_lock);
+}
@@ -0,0 +1,38 @@
+#ifndef JOS_KERN_SWAP_H
+#define JOS_KERN_SWAP_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+#include <inc/memlayout.h>
+
+/*
+ * Swapping of anonymous user pages to the second IDE disk.
+ *
+ * The disk is divided into page-sized slots. When page_reclaim finds a cold
+ * anonymous page, swap_out writes it to a free slot, frees the page and
+ * leaves a swap entry in the PTE: the PTE is not present and holds the slot
+ * number where the physical address would be, marked by PTE_SWAP. The page
+ * fault handler reads the page back with swap_in. A slot is reference
+ * counted, so fork can share swap entries like it shares pages.
+ */
+#define SWAP_DISK       1       /* IDE disk holding the swap area */
+#define SWAP_SLOTS      8192    /* 32MB; kern/Makefrag sizes swap.img to match */
+
+/* Software PTE bit: a non-present PTE with this bit set is a swap entry */
+#define PTE_SWAP        0x800
+
+#define PTE_SWAPPED(pte)    (((pte) & (PTE_P | PTE_SWAP)) == PTE_SWAP)
+#define PTE_SLOT(pte)       ((pte) >> PTXSHIFT)
+
+void swap_init(void);
+bool swap_enabled(void);
+bool swap_out(pde_t *pgdir, void *va);
+int  swap_in(pde_t *pgdir, void *va, int perm);
+void swap_dup(pte_t pte);
+void swap_free(pte_t pte);
+void swap_stats(struct page_stats *st);
+
+#endif /* !JOS_KERN_SWAP_H */
@@ -12,6 +12,8 @@
 #include <kern/console.h>
 #include <kern/sched.h>
 #include <kern/vma.h>
+#include <kern/swap.h>
+#include <kern/uaccess.h>
 
 /*
  * Print a string to the system console.
@@ -20,14 +22,26 @@
  */
 static void sys_cputs(const char *s, size_t len)
 {
-    /* Check that the user has permission to read memory [s, s+len).
-     * Destroy the environment if not. */
-
-    /* LAB 3: Your code here. */
-    user_mem_assert(curenv, s, len, PTE_U);
+    char buf[128];
+
+    /* Print the string supplied by the user, a buffer at a time. Pages of
+     * the string that are not mapped yet are faulted in by the copy. */
+    while (len > 0) {
+        size_t n = MIN(len, sizeof(buf));
+        size_t left = copy_from_user(buf, s, n);
+
+        /* Destroy the environment if it may not read memory [s, s+len). */
+        if (left) {
+            cprintf("[%08x] user_mem_check assertion failure for "
+                "va %08x\n", curenv->env_id, s + n - left);
+            env_destroy(curenv);
+            return;
+        }
 
-    /* Print the string supplied by the user. */
-    cprintf("%.*s", len, s);
+        cprintf("%.*s", n, buf);
+        s += n;
+        len -= n;
+    }
 }
 
 /*
@@ -94,32 +108,15 @@ static int sys_fork(void)
 
     // copy parent VMA into child VMA
     vma_init(new);
-    memcpy(new->env_vmas, curenv->env_vmas, VMA_LENGTH * sizeof(struct vma));
-
-    // copy all VMA-backed pages into child pgdir
-    for (size_t i = 0; i < VMA_LENGTH; i++) {
-        if (curenv->env_vmas[i].type == VMA_UNUSED)
-            continue;
-
-        // copy page by page
-        void *start = ROUNDDOWN(curenv->env_vmas[i].va, PGSIZE);
-        void *end = ROUNDUP(curenv->env_vmas[i].va + curenv->env_vmas[i].len, PGSIZE);
-
-        for (void *addr = start; addr < end; addr += PGSIZE) {
-            pte_t *pte = NULL;
-            struct page_info *pp = page_lookup(curenv->env_pgdir, addr, &pte);
-            if (!pp) continue;
-
-            // copy pages copied from parent to child as COW
-            int perm = curenv->env_vmas[i].perm & ~PTE_W;
-            page_insert(new->env_pgdir, pp, addr, perm);
-
-            // also mark parent's own pages as COW
-            *pte &= ~PTE_W;
-            tlb_invalidate(curenv->env_pgdir, addr);
-        }
+    if (vma_clone(new, curenv) < 0) {
+        env_free(new);
+        return -1;
     }
 
+    // share the parent's page tables; they are copied on the first change,
+    // and the pages in them become copy-on-write then
+    pt_share(new->env_pgdir, curenv->env_pgdir);
+
     // copy parent registers into child registers
     memcpy(&new->env_tf, &curenv->env_tf, sizeof(struct trapframe));
 
@@ -145,21 +142,18 @@ static void *sys_vma_create(size_t size, int perm, int flags, int key)
     char *mem = vma_find_mem(curenv, size);
     if (!mem) return (void *) -1;
 
-    // insert the VMA block
-    struct vma *v = vma_new(curenv, mem, size, perm, NULL, NULL);
-    if (v < 0) return (void *) -1;
-    v->shmem_key = key;
-
-    // populate by triggering a page fault on each created VMA page
-    // the compiler doesn't seem to particularly like this, though
-    // it forces the { } even though they aren't needed here?
-    /*
-    if (flags & MAP_POPULATE) {
-        for (int i = 0; i < size; i += PGSIZE) {
-            volatile int z = *(mem + i);
-        }
-    }
-    */
+    // insert the VMA block; shared memory gets its key before it could be
+    // merged with a neighbour
+    struct vma *v = key ? vma_new_shmem(curenv, mem, size, perm, key)
+                        : vma_new(curenv, mem, size, perm, NULL, NULL);
+    if (!v) return (void *) -1;
+
+    // map the whole region now rather than taking a fault on every page; if
+    // it cannot even be taken back, it stays as an ordinary lazy region
+    if ((flags & MAP_POPULATE)
+        && vma_populate(curenv, v, mem, size, 0) < 0
+        && vma_rmv(curenv, mem, size, VMA_DESTROY_PHYS) == 0)
+        return (void *) -1;
 
     return mem;
 }
@@ -170,8 +164,62 @@ static void *sys_vma_create(size_t size, int perm, int flags, int key)
  */
 static int sys_vma_destroy(void *va, size_t size)
 {
-   vma_rmv(curenv, va, size, VMA_DESTROY_PHYS);
-   return 0;
+   return vma_rmv(curenv, va, size, VMA_DESTROY_PHYS);
+}
+
+/*
+ * Gives the kernel a hint about how the range starting at virtual address
+ * 'va', 'size' bytes long, will be accessed. See vma_advise for the advice.
+ */
+static int sys_vma_advise(void *va, size_t size, int advice)
+{
+    return vma_advise(curenv, va, size, advice);
+}
+
+/*
+ * Changes the permissions of the range starting at virtual address 'va',
+ * 'size' bytes long, to 'perm' (PERM_R, PERM_W, or 0 for no access), keeping
+ * its contents.
+ */
+static int sys_vma_protect(void *va, size_t size, int perm)
+{
+    return vma_protect(curenv, va, size, perm);
+}
+
+/*
+ * Maps 'size' bytes of the data disk, starting at sector 'secno', somewhere in
+ * the virtual address space. Pages are read from the disk on first access;
+ * written pages go back to the disk on sys_disk_sync and when unmapped.
+ *
+ * Returns the address to the start of the new mapping, on success,
+ * or -1 if request could not be satisfied.
+ */
+static void *sys_disk_map(uint32_t secno, size_t size, int perm)
+{
+    if (!size || size > VMA_DISK_SECTS * SECTSIZE)
+        return (void *) -1;
+
+    size = ROUNDUP(size, PGSIZE);
+    if (secno >= VMA_DISK_SECTS || size / SECTSIZE > VMA_DISK_SECTS - secno)
+        return (void *) -1;
+
+    char *mem = vma_find_mem(curenv, size);
+    if (!mem) return (void *) -1;
+
+    if (!vma_new_disk(curenv, mem, size, perm & PTE_W, secno))
+        return (void *) -1;
+    return mem;
+}
+
+/*
+ * Writes the written pages of the disk mappings in the range starting at
+ * virtual address 'va', 'size' bytes long, back to the disk.
+ */
+static int sys_disk_sync(void *va, size_t size)
+{
+    if ((uintptr_t) va + size < (uintptr_t) va || (uintptr_t) va + size > UTOP)
+        return -E_INVAL;
+    return vma_sync(curenv, va, size);
 }
 
 static envid_t sys_ipc_recv(void *dst, size_t *sz) {
@@ -204,26 +252,43 @@ static void *sys_shmem_alloc(size_t sz, int key) {
 static void *sys_shmem_attach(int key) {
     // search in each environment's VMA list to find the shared memory
     for (size_t e = 0; e < NENV; e++) {
-        for (size_t v = 0; v < VMA_LENGTH; v++) {
+        // free environments no longer own a VMA tree
+        if (envs[e].env_status == ENV_FREE || !envs[e].env_vmas)
+            continue;
+
+        for (struct vma *shm = vma_first(&envs[e]); shm;
+             shm = vma_next(&envs[e], shm)) {
             // shared memory found!
-            if (envs[e].env_vmas[v].shmem_key == key) {
+            if (shm->shmem_key == key) {
                 // add to my VMA
-                vma_new(curenv, envs[e].env_vmas[v].va, envs[e].env_vmas[v].len,
-                        envs[e].env_vmas[v].perm, NULL, NULL);
-
-                // add a link to each page
-                void *start = ROUNDDOWN(curenv->env_vmas[v].va, PGSIZE);
-                void *end = ROUNDUP(curenv->env_vmas[v].va + curenv->env_vmas[v].len, PGSIZE);
-
-                for (void *addr = start; addr < end; addr += PGSIZE) {
-                    pte_t *pte = NULL;
-                    struct page_info *pp = page_lookup(envs[e].env_pgdir, addr, &pte);
-                    if (!pp) continue;
-                    page_insert(curenv->env_pgdir, pp, addr, envs[e].env_vmas[v].perm);
+                vma_new_shmem(curenv, shm->va, shm->len, shm->perm, key);
+
+                // add a link to each page the owner has mapped
+                void *start = ROUNDDOWN(shm->va, PGSIZE);
+                void *end = ROUNDUP(shm->va + shm->len, PGSIZE);
+                struct pt_walk w;
+
+                pt_walk_init(&w, envs[e].env_pgdir, start, end);
+                while (pt_walk_next(&w)) {
+                    struct page_info *pp;
+
+                    if (!(*w.pte & PTE_P))
+                        continue;
+                    pp = pa2page(PTE_ADDR(*w.pte));
+                    if (w.size == PTSIZE
+                        && page_insert(curenv->env_pgdir, pp, (void *) w.va,
+                                       shm->perm | PTE_U | PTE_PS) == 0)
+                        continue;
+
+                    // a page table of ours is in the way of a huge page;
+                    // map its 4K pages one by one instead
+                    for (size_t off = 0; off < w.size; off += PGSIZE)
+                        page_insert(curenv->env_pgdir, pp + off / PGSIZE,
+                                    (void *) (w.va + off), shm->perm | PTE_U);
                 }
 
                 // return the address of the shared VMA
-                return envs[e].env_vmas[v].va;
+                return shm->va;
             }
         }
     }
@@ -250,6 +315,14 @@ int32_t syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3,
             return (int) sys_vma_create(a1, a2, a3, 0);
         case SYS_vma_destroy:
             return (int) sys_vma_destroy((void *) a1, a2);
+        case SYS_vma_advise:
+            return sys_vma_advise((void *) a1, a2, a3);
+        case SYS_vma_protect:
+            return sys_vma_protect((void *) a1, a2, a3);
+        case SYS_disk_map:
+            return (uint32_t) sys_disk_map(a1, a2, a3);
+        case SYS_disk_sync:
+            return sys_disk_sync((void *) a1, a2);
         case SYS_wait:
             return sys_wait(a1);
         case SYS_yield:
@@ -2,6 +2,7 @@
 #include <inc/x86.h>
 #include <inc/assert.h>
 #include <inc/string.h>
+#include <inc/error.h>
 
 #include <kern/pmap.h>
 #include <kern/trap.h>
@@ -11,6 +12,9 @@
 #include <kern/syscall.h>
 #include <kern/vma.h>
 #include <kern/sched.h>
+#include <kern/swap.h>
+#include <kern/bincache.h>
+#include <kern/uaccess.h>
 
 static struct taskstate ts;
 
@@ -84,6 +88,7 @@ void traphandler_mc();
 void traphandler_xm();
 void traphandler_ve();
 void traphandler_syscall();
+void traphandler_tlbflush();
 void irq_timer();
 void irq_kbd();
 void irq_serial();
@@ -120,6 +125,7 @@ void trap_init(void)
     // 16..32 reserved
     // 33..47 ?
     SETGATE(idt[48], 0, GD_KT, traphandler_syscall, 3);
+    SETGATE(idt[T_TLBFLUSH], 0, GD_KT, traphandler_tlbflush, 0);
 
     SETGATE(idt[IRQ_OFFSET + IRQ_TIMER], 0, GD_KT, irq_timer, 0);
     SETGATE(idt[IRQ_OFFSET + IRQ_KBD], 0, GD_KT, irq_kbd, 0);
@@ -222,10 +228,19 @@ static void trap_dispatch(struct trapframe *tf)
     if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER) {
         lapic_eoi();
         //cprintf("Timer interrupt\n");
+        if (cpunum() == 0)
+            page_stats_update();
         sched_yield(false);
         return;
     }
 
+    /* Another CPU changed page tables this CPU has loaded */
+    if (tf->tf_trapno == T_TLBFLUSH) {
+        lapic_eoi();
+        tlb_shootdown_handler();
+        return;
+    }
+
     //print_trapframe(tf);
 
     // redirect pagefaults
@@ -300,81 +315,324 @@ void trap(struct trapframe *tf)
 }
 
 /*
- * Handles a page fault for an anonymous pagefault
+ * Handles a page fault for an anonymous pagefault.
+ * If the VMA covers the whole 4MB-aligned region around va and nothing is
+ * mapped there yet, the region is backed by a single huge page if one is
+ * free. Otherwise a 4K page is mapped, and, depending on the VMA's advice,
+ * unmapped pages around it as far as memory is free.
+ * Returns 0 on success, -1 if memory ran out.
+ */
+int resolve_anonymous(struct vma *v, void *va) {
+    void *huge_va = ROUNDDOWN(va, PTSIZE);
+    struct page_info *pp;
+
+    if (v->va <= huge_va && huge_va + PTSIZE <= v->va + v->len
+        && !(curenv->env_pgdir[PDX(va)] & PTE_P)) {
+        pp = page_alloc(ALLOC_HUGE | ALLOC_ZERO | ALLOC_HIGHMEM);
+        if (pp && page_insert(curenv->env_pgdir, pp, huge_va,
+                              v->perm | PTE_U | PTE_PS) == 0)
+            return 0;
+        if (pp)
+            page_free(pp);
+    }
+
+    pp = page_alloc(ALLOC_ZERO | ALLOC_HIGHMEM);
+    if (!pp)
+        return -1;
+    if (page_insert(curenv->env_pgdir, pp, (char *) ROUNDDOWN(va, PGSIZE),
+                    v->perm | PTE_U) < 0) {
+        page_free(pp);
+        return -1;
+    }
+
+    // sequential accesses to the neighbours then need no fault of their own;
+    // this is best effort and never reclaims memory for it
+    switch (v->advice) {
+        case MADV_RANDOM:
+            break;
+        case MADV_SEQUENTIAL:
+            vma_populate(curenv, v, ROUNDDOWN(va, PGSIZE),
+                         VMA_READAHEAD * PGSIZE, ALLOC_NORECLAIM);
+            break;
+        default:
+            if (VMA_FAULT_AROUND > 1)
+                vma_populate(curenv, v, ROUNDDOWN(va, VMA_FAULT_AROUND * PGSIZE),
+                             VMA_FAULT_AROUND * PGSIZE, ALLOC_NORECLAIM);
+            break;
+    }
+    return 0;
+}
+
+/*
+ * Handles a page fault on a binary VMA by reading the page back from the ELF
+ * image: the part of the page that lies in the segment's file data is copied,
+ * the rest of the page is zero. Read-only pages are shared through the binary
+ * page cache by all environments running the same image.
+ * Returns 0 on success, -1 if memory ran out.
  */
-void resolve_anonymous(void *va, int perm) {
-    struct page_info *pp = page_alloc(ALLOC_ZERO);
-    if (!pp) cprintf("Pagefault -- page_alloc failure.\n");
-    page_insert(curenv->env_pgdir, pp, (char *) ROUNDDOWN(va, PGSIZE),
-                perm | PTE_U);
+int resolve_binary(struct vma *v, void *va) {
+    uintptr_t page = ROUNDDOWN((uintptr_t) va, PGSIZE);
+    uintptr_t seg = v->ph->p_va;
+    uintptr_t start = MAX(page, seg);
+    uintptr_t end = MIN(page + PGSIZE, seg + v->ph->p_filesz);
+    bool shared = !(v->perm & PTE_W);
+    struct page_info *pp;
+
+    if (shared && (pp = bincache_lookup(v->bin, page)))
+        return page_insert(curenv->env_pgdir, pp, (void *) page,
+                           v->perm | PTE_U) < 0 ? -1 : 0;
+
+    pp = page_alloc(ALLOC_ZERO | ALLOC_HIGHMEM);
+    if (!pp)
+        return -1;
+
+    if (start < end) {
+        char *kva = kmap(pp);
+        memcpy(kva + (start - page), v->bin + v->ph->p_offset + (start - seg),
+               end - start);
+        kunmap(kva);
+    }
+
+    if (page_insert(curenv->env_pgdir, pp, (void *) page, v->perm | PTE_U) < 0) {
+        page_free(pp);
+        return -1;
+    }
+    if (shared)
+        bincache_add(v->bin, page, pp);
+    return 0;
 }
 
-void page_fault_handler(struct trapframe *tf)
+/*
+ * Handles a page fault on a disk VMA by reading the page's sectors from the
+ * disk.
+ * Returns 0 on success, -1 if memory ran out, -E_IO if the disk failed.
+ */
+int resolve_disk(struct vma *v, void *va) {
+    uintptr_t page = ROUNDDOWN((uintptr_t) va, PGSIZE);
+    struct page_info *pp;
+    int r;
+
+    pp = page_alloc(ALLOC_HIGHMEM);
+    if (!pp)
+        return -1;
+
+    char *kva = kmap(pp);
+    r = ide_read(VMA_DISKNO, vma_disk_sector(v, page), kva, SECTPERPAGE);
+    kunmap(kva);
+
+    if (r < 0 || page_insert(curenv->env_pgdir, pp, (void *) page,
+                             v->perm | PTE_U) < 0) {
+        page_free(pp);
+        return r < 0 ? -E_IO : -1;
+    }
+    return 0;
+}
+
+/*
+ * Copies 'n' consecutive physical pages, which may live in high memory.
+ */
+static void copy_pages(struct page_info *dst, struct page_info *src, size_t n)
 {
-    uint32_t fault_va = rcr2();
+    for (size_t i = 0; i < n; i++) {
+        void *s = kmap(src + i);
+        void *d = kmap(dst + i);
+        memcpy(d, s, PGSIZE);
+        kunmap(d);
+        kunmap(s);
+    }
+}
+
+/*
+ * Returns whether the PTE for 'va' in 'pgdir' is a swap entry.
+ */
+static bool is_swapped(pde_t *pgdir, void *va)
+{
+    pte_t *pte = pgdir_walk(pgdir, va, 0);
+    return pte && PTE_SWAPPED(*pte);
+}
+
+/*
+ * Gives user access back to the page at 'va' in 'pgdir' if it is present
+ * without it. Only a vma_protect that failed halfway leaves such a page in an
+ * accessible VMA; its contents are still valid.
+ * Returns whether access was restored.
+ */
+static bool restore_access(pde_t *pgdir, void *va)
+{
+    pte_t *pte = pgdir_walk(pgdir, va, 0);
 
-    // filter kernel pagefault
-    if (!(tf->tf_cs & 3))
-        panic("Kernel page fault at va: %p!", fault_va);
+    if (!pte || (*pte & (PTE_P | PTE_U)) != PTE_P)
+        return false;
+    *pte |= PTE_U;
+    tlb_invalidate(pgdir, va);
+    return true;
+}
 
-    // usermode
-    int slot = vma_seek(curenv, (void *) fault_va);
-    struct vma *v = &curenv->env_vmas[slot];
+/*
+ * Resolves a page fault of the current environment at 'fault_va' with error
+ * code 'err' from its VMAs. The fault may come from user mode or from kernel
+ * code accessing user memory on its behalf.
+ * Returns 0 if the access can be retried, -1 after explaining why not.
+ */
+static int resolve_fault(uint32_t fault_va, uint32_t err)
+{
+    struct vma *v = vma_lookup(curenv, (void *) fault_va);
 
     // faulted on invalid address
-    if (slot < 0)
+    if (!v)
         cprintf("Pagefault -- No vma slot for %x.\n", fault_va);
 
+    // faulted on a VMA protected against all access
+    else if (!(v->perm & PTE_U))
+        cprintf("Pagefault -- No access to vma at %x.\n", fault_va);
+
+    // faulted in a page table still shared after fork; take a copy of it
+    // before any of its entries change
+    else if (pt_unshare(curenv->env_pgdir, (void *) fault_va) < 0)
+        cprintf("Pagefault -- pt_unshare failure.\n");
+
+    // faulted on a page that was swapped out; it comes back writable if the
+    // VMA is, as the copy read from swap is private
+    else if (is_swapped(curenv->env_pgdir, (void *) fault_va)) {
+        if (swap_in(curenv->env_pgdir, (void *) fault_va, v->perm | PTE_U) == 0)
+            return 0;
+        cprintf("Pagefault -- swap_in failure.\n");
+    }
+
+    // write access, if any, comes back through the copy-on-write path on
+    // the next fault
+    else if (restore_access(curenv->env_pgdir, (void *) fault_va))
+        return 0;
+
     // faulted on write request
-    else if ((v->perm & (PTE_W)) == PTE_W && ((tf->tf_err & PTE_W) == PTE_W)) {
+    else if ((v->perm & (PTE_W)) == PTE_W && ((err & PTE_W) == PTE_W)) {
 
         // check if pte exists
         pte_t *pte = NULL;
         struct page_info *pp_orig =
           page_lookup(curenv->env_pgdir, (void *) fault_va, &pte);
 
+        // resolve COW pagefault on a huge page: copy it as a whole if a
+        // huge page is free, otherwise split the mapping and copy only the
+        // 4K page that was written
+        if (pp_orig && (*pte & PTE_PS) && page_head(pp_orig)->pp_ref > 1) {
+            struct page_info *php_copy = page_alloc(ALLOC_HUGE | ALLOC_HIGHMEM);
+            if (php_copy) {
+                copy_pages(php_copy, page_head(pp_orig), NPTENTRIES);
+                page_insert(curenv->env_pgdir, php_copy,
+                            (char *) ROUNDDOWN(fault_va, PTSIZE),
+                            v->perm | PTE_PS);
+                return 0;
+            }
+
+            if (page_split(curenv->env_pgdir, (void *) fault_va) < 0) {
+                cprintf("Pagefault -- page_split failure.\n");
+                return -1;
+            }
+            pte = pgdir_walk(curenv->env_pgdir, (void *) fault_va, 0);
+        }
+
         // resolve COW pagefault
         if (pp_orig && (*pte & PTE_P) == PTE_P) {
 
-            // if this is the last reference remaining, just use it in-place
-            if (pp_orig->pp_ref == 1)
+            // if this is the last reference remaining, just use it in-place;
+            // this also covers the 4K pages of a huge page that was split
+            // in this address space only
+            if (page_private(curenv->env_pgdir, pp_orig, (void *) fault_va))
                 *pte |= PTE_W;
 
             // if more references remain, make a physical copy to retain old one
             else {
-                struct page_info *pp_copy = page_alloc(0);
-                if (!pp_copy) cprintf("Pagefault -- page_alloc failure.\n");
-                memcpy(page2kva(pp_copy), page2kva(pp_orig), PGSIZE);
+                struct page_info *pp_copy = page_alloc(ALLOC_HIGHMEM);
+                if (!pp_copy) {
+                    cprintf("Pagefault -- page_alloc failure.\n");
+                    return -1;
+                }
+                copy_pages(pp_copy, pp_orig, 1);
                 page_insert(curenv->env_pgdir, pp_copy,
                             (char *) ROUNDDOWN(fault_va, PGSIZE), v->perm);
             }
 
-            return;
+            return 0;
+        }
+
+        // resolve binary write pagefault; the page may have been reclaimed
+        if (v->type == VMA_BINARY) {
+            if (resolve_binary(v, (void *) fault_va) == 0)
+                return 0;
+            cprintf("Pagefault -- page_alloc failure.\n");
+        }
+
+        // resolve disk write pagefault
+        else if (v->type == VMA_DISK) {
+            if (resolve_disk(v, (void *) fault_va) == 0)
+                return 0;
+            cprintf("Pagefault -- disk read failure.\n");
         }
 
         // resolve anonymous write pagefault
-        resolve_anonymous((void *) fault_va, v->perm);
-        return;
+        else if (resolve_anonymous(v, (void *) fault_va) == 0)
+            return 0;
+        else
+            cprintf("Pagefault -- page_alloc failure.\n");
     }
 
     // faulted on write request for read-only, non-COW page
-    else if ((tf->tf_err & PTE_W) == PTE_W)
+    else if ((err & PTE_W) == PTE_W)
         cprintf("Pagefault -- Write request on Read-Only page.\n");
 
     // faulted on a binary page
-    else if (v->type == VMA_BINARY)
-        cprintf("Pagefault -- Transfer of binary pages not supported.\n");
+    else if (v->type == VMA_BINARY) {
+        if (resolve_binary(v, (void *) fault_va) == 0)
+            return 0;
+        cprintf("Pagefault -- page_alloc failure.\n");
+    }
+
+    // faulted on a disk page
+    else if (v->type == VMA_DISK) {
+        if (resolve_disk(v, (void *) fault_va) == 0)
+            return 0;
+        cprintf("Pagefault -- disk read failure.\n");
+    }
 
     // faulted on read request
     else if (v->type == VMA_ANON) {
-        resolve_anonymous((void *) fault_va, v->perm);
-        return;
+        if (resolve_anonymous(v, (void *) fault_va) == 0)
+            return 0;
+        cprintf("Pagefault -- page_alloc failure.\n");
     }
 
     // unexpected pagefault type
     else
         cprintf("Pagefault -- Unexpected params for this pagefault.\n");
 
+    return -1;
+}
+
+void page_fault_handler(struct trapframe *tf)
+{
+    uint32_t fault_va = rcr2();
+
+    // kernel pagefaults are only expected on user memory, in the user access
+    // routines of kern/uaccess.c; the faulting access is retried if the page
+    // can be brought in, otherwise the routine's fixup reports the failure
+    if (!(tf->tf_cs & 3)) {
+        uintptr_t fixup = extable_fixup(tf->tf_eip);
+
+        if (!fixup || !curenv || curenv->env_type == ENV_TYPE_KERNELTHREAD
+            || fault_va >= ULIM) {
+            print_trapframe(tf);
+            panic("Kernel page fault at va: %p!", fault_va);
+        }
+
+        if (resolve_fault(fault_va, tf->tf_err) < 0)
+            tf->tf_eip = fixup;
+        env_pop_tf(tf);
+    }
+
+    if (resolve_fault(fault_va, tf->tf_err) == 0)
+        return;
+
     // destroy the environment that caused the fault
     cprintf("[%08x] user fault va %08x ip %08x\n", curenv->env_id, fault_va, tf->tf_eip);
     print_trapframe(tf);
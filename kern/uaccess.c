@@ -0,0 +1,99 @@
+/*
+ * Fault-tolerant copies between kernel and user memory.
+ */
+
+#include <inc/memlayout.h>
+
+#include <kern/uaccess.h>
+#include <kern/env.h>
+#include <kern/vma.h>
+
+/* Bounds of the exception table, see kern/kernel.ld */
+extern const struct extable_entry __EXTABLE_BEGIN__[], __EXTABLE_END__[];
+
+/*
+ * Returns whether [va, va+len) lies in the user part of the address space.
+ */
+static bool user_range(const void *va, size_t len)
+{
+    uintptr_t start = (uintptr_t) va;
+    return start + len >= start && start + len <= ULIM;
+}
+
+/*
+ * Returns how many of the 'len' bytes at user address 'va' come before the
+ * first VMA of the current environment that is protected against all access.
+ * Its pages stay present for the kernel, so copying from them would not fault.
+ */
+static size_t user_accessible(const void *va, size_t len)
+{
+    uintptr_t start = (uintptr_t) va, end = start + len;
+
+    for (struct vma *v = vma_find_from(curenv, (void *) va);
+         v && (uintptr_t) v->va < end; v = vma_next(curenv, v))
+        if (!(v->perm & PTE_U))
+            return MAX((uintptr_t) v->va, start) - start;
+    return len;
+}
+
+/*
+ * Copies 'len' bytes with a single string instruction listed in the
+ * exception table. If it faults for good, the fixup lands right after it
+ * with %ecx still counting the bytes left.
+ * Returns the number of bytes not copied.
+ */
+static size_t user_copy(void *dst, const void *src, size_t len)
+{
+    asm volatile("1:  rep movsb\n"
+                 "2:\n"
+                 ".pushsection .extable, \"a\"\n"
+                 "    .balign 4\n"
+                 "    .long 1b, 2b\n"
+                 ".popsection"
+                 : "+D" (dst), "+S" (src), "+c" (len)
+                 :
+                 : "memory", "cc");
+    return len;
+}
+
+/*
+ * Copies 'len' bytes from user address 'usrc' to 'dst'.
+ * Returns the number of bytes that could not be copied; the first of them is
+ * at usrc + len - returned. Ranges reaching above ULIM are not copied at all.
+ */
+size_t copy_from_user(void *dst, const void *usrc, size_t len)
+{
+    size_t n;
+
+    if (!user_range(usrc, len))
+        return len;
+    n = user_accessible(usrc, len);
+    return user_copy(dst, usrc, n) + len - n;
+}
+
+/*
+ * Copies 'len' bytes from 'src' to user address 'udst'.
+ * Returns the number of bytes that could not be copied, like copy_from_user.
+ */
+size_t copy_to_user(void *udst, const void *src, size_t len)
+{
+    size_t n;
+
+    if (!user_range(udst, len))
+        return len;
+    n = user_accessible(udst, len);
+    return user_copy(udst, src, n) + len - n;
+}
+
+/*
+ * Returns the fixup address for a fault at 'eip', or 0 if faults there are
+ * not expected.
+ */
+uintptr_t extable_fixup(uintptr_t eip)
+{
+    for (const struct extable_entry *e = __EXTABLE_BEGIN__;
+         e < __EXTABLE_END__; e++)
+        if (e->insn == eip)
+            return e->fixup;
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef JOS_KERN_UACCESS_H
+#define JOS_KERN_UACCESS_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+/*
+ * Access to user memory from system calls.
+ *
+ * The copy routines touch user memory directly, without checking the page
+ * tables first. A page fault they cause is handled like a fault of the
+ * environment itself: missing pages of its VMAs are brought in and the copy
+ * continues. If the fault cannot be resolved, page_fault_handler resumes the
+ * routine at the fixup address the exception table lists for the faulting
+ * instruction, and the routine reports how much it could not copy.
+ */
+struct extable_entry {
+    uintptr_t insn;     /* instruction that may fault on user memory */
+    uintptr_t fixup;    /* where to continue if the fault is not resolved */
+};
+
+size_t copy_from_user(void *dst, const void *usrc, size_t len);
+size_t copy_to_user(void *udst, const void *src, size_t len);
+uintptr_t extable_fixup(uintptr_t eip);
+
+#endif /* !JOS_KERN_UACCESS_H */
@@ -1,255 +1,766 @@
 #include <kern/vma.h>
+#include <kern/kmem.h>
+#include <inc/error.h>
+
+// slab cache for the VMA tree nodes
+static struct kmem_cache *vma_cache;
+
+/*
+ * AVL tree helpers. The VMAs of an environment never overlap, so ordering them
+ * by start address also orders them by end address.
+ */
+static int vma_height(struct vma *n)
+{
+    return n ? n->height : 0;
+}
+
+/* Page-rounded start and end of a VMA. */
+static uintptr_t vma_start(struct vma *v)
+{
+    return ROUNDDOWN((uintptr_t) v->va, PGSIZE);
+}
+
+static uintptr_t vma_end(struct vma *v)
+{
+    return ROUNDUP((uintptr_t) v->va + v->len, PGSIZE);
+}
+
+/* Size of the hole between 'lo' and 'hi'; unaligned VMAs may share a page. */
+static size_t vma_gap(uintptr_t lo, uintptr_t hi)
+{
+    return hi > lo ? hi - lo : 0;
+}
+
+/*
+ * Recomputes the height and the gap summary of 'n' from its children.
+ */
+static void vma_update(struct vma *n)
+{
+    n->height = 1 + MAX(vma_height(n->left), vma_height(n->right));
+    n->lo = vma_start(n);
+    n->hi = vma_end(n);
+    n->max_gap = 0;
+
+    if (n->left) {
+        n->lo = n->left->lo;
+        n->max_gap = MAX(n->left->max_gap, vma_gap(n->left->hi, vma_start(n)));
+    }
+    if (n->right) {
+        n->hi = n->right->hi;
+        n->max_gap = MAX(n->max_gap, n->right->max_gap);
+        n->max_gap = MAX(n->max_gap, vma_gap(vma_end(n), n->right->lo));
+    }
+}
+
+static struct vma *vma_rotate_left(struct vma *n)
+{
+    struct vma *r = n->right;
+    n->right = r->left;
+    r->left = n;
+    vma_update(n);
+    vma_update(r);
+    return r;
+}
+
+static struct vma *vma_rotate_right(struct vma *n)
+{
+    struct vma *l = n->left;
+    n->left = l->right;
+    l->right = n;
+    vma_update(n);
+    vma_update(l);
+    return l;
+}
+
+static struct vma *vma_rebalance(struct vma *n)
+{
+    int balance = vma_height(n->left) - vma_height(n->right);
+
+    vma_update(n);
+    if (balance > 1) {
+        if (vma_height(n->left->left) < vma_height(n->left->right))
+            n->left = vma_rotate_left(n->left);
+        return vma_rotate_right(n);
+    }
+    if (balance < -1) {
+        if (vma_height(n->right->right) < vma_height(n->right->left))
+            n->right = vma_rotate_right(n->right);
+        return vma_rotate_left(n);
+    }
+    return n;
+}
+
+static struct vma *vma_tree_insert(struct vma *root, struct vma *v)
+{
+    if (!root) {
+        v->left = v->right = NULL;
+        vma_update(v);
+        return v;
+    }
+    if (v->va < root->va)
+        root->left = vma_tree_insert(root->left, v);
+    else
+        root->right = vma_tree_insert(root->right, v);
+    return vma_rebalance(root);
+}
+
+static struct vma *vma_tree_remove_min(struct vma *n, struct vma **min)
+{
+    if (!n->left) {
+        *min = n;
+        return n->right;
+    }
+    n->left = vma_tree_remove_min(n->left, min);
+    return vma_rebalance(n);
+}
+
+static struct vma *vma_tree_erase(struct vma *root, struct vma *v)
+{
+    struct vma *min;
+
+    assert(root);
+    if (root == v) {
+        if (!v->left)
+            return v->right;
+        if (!v->right)
+            return v->left;
+        struct vma *right = vma_tree_remove_min(v->right, &min);
+        min->left = v->left;
+        min->right = right;
+        return vma_rebalance(min);
+    }
+    if (v->va < root->va)
+        root->left = vma_tree_erase(root->left, v);
+    else
+        root->right = vma_tree_erase(root->right, v);
+    return vma_rebalance(root);
+}
+
+/*
+ * Refreshes the gap summaries on the path from 'root' down to 'v' after the
+ * bounds of 'v' changed without changing its position in the tree.
+ */
+static void vma_tree_fixup(struct vma *root, struct vma *v)
+{
+    if (root != v)
+        vma_tree_fixup(v->va < root->va ? root->left : root->right, v);
+    vma_update(root);
+}
+
+/*
+ * Returns the start of the lowest hole in [UTEXT, USTACKTOP) between 'lo' and
+ * 'hi' that is larger than 'len', or 0 if there is none.
+ */
+static uintptr_t vma_gap_fit(uintptr_t lo, uintptr_t hi, size_t len)
+{
+    lo = MAX(lo, (uintptr_t) UTEXT);
+    hi = MIN(hi, (uintptr_t) USTACKTOP);
+    return vma_gap(lo, hi) > len ? lo : 0;
+}
+
+/*
+ * Returns the start of the lowest hole larger than 'len' between two VMAs of
+ * the subtree at 'n', or 0 if there is none. Subtrees without a large enough
+ * hole are skipped as a whole.
+ */
+static uintptr_t vma_tree_find_gap(struct vma *n, size_t len)
+{
+    uintptr_t va;
+
+    if (!n || n->max_gap <= len)
+        return 0;
+    if ((va = vma_tree_find_gap(n->left, len)))
+        return va;
+    if (n->left && (va = vma_gap_fit(n->left->hi, vma_start(n), len)))
+        return va;
+    if (n->right && (va = vma_gap_fit(vma_end(n), n->right->lo, len)))
+        return va;
+    return vma_tree_find_gap(n->right, len);
+}
+
+static void vma_tree_free(struct vma *n)
+{
+    if (!n)
+        return;
+    vma_tree_free(n->left);
+    vma_tree_free(n->right);
+    kmem_cache_free(vma_cache, n);
+}
 
 /*
- * Initializes the VMA chain for an environment.
- * Panics on failure.
+ * Initializes the (empty) VMA tree for an environment.
  */
 void vma_init(struct env *e) {
-    // allocate a page
-    struct page_info *pp = page_alloc(ALLOC_ZERO);
-    if (!pp) panic("Could not create VMA structure for env %x\n", e->env_id);
-    pp->pp_ref += 1;
+    if (!vma_cache)
+        vma_cache = kmem_cache_create("vma", sizeof(struct vma));
 
-    // store reference
-    e->env_vmas = page2kva(pp);
+    e->env_vmas = NULL;
 }
 
 /*
- * Inserts a new VMA block into the chain.
- * Returns -1 on failure
+ * Releases the VMA tree of an environment. Does not touch the mappings.
  */
-struct vma *vma_new(struct env *e, void *va, size_t len, int perm,
-             struct elf_proghdr *ph, uint8_t *bin)
+void vma_free(struct env *e) {
+    vma_tree_free(e->env_vmas);
+    e->env_vmas = NULL;
+}
+
+/*
+ * Copies the VMA tree of 'src' into the empty tree of 'dst'.
+ * Returns 0 on success, -1 if out of memory; the VMAs copied so far are left
+ * in 'dst' for vma_free.
+ */
+int vma_clone(struct env *dst, struct env *src)
 {
-    assert(len > 0);
+    for (struct vma *v = vma_first(src); v; v = vma_next(src, v)) {
+        struct vma *copy = kmem_cache_alloc(vma_cache, 0);
+        if (!copy)
+            return -1;
+        *copy = *v;
+        dst->env_vmas = vma_tree_insert(dst->env_vmas, copy);
+    }
+    return 0;
+}
 
-    // find VMA block
-    int slot = vma_find_free_slot(e);
-    if (slot < 0) return (void *)-1;
-    struct vma *v = &e->env_vmas[slot];
+#ifdef VMA_MERGE
+/*
+ * Returns whether adjacent VMAs 'a' and 'b' can be joined into one.
+ */
+static bool vma_mergeable(struct vma *a, struct vma *b)
+{
+#ifdef BONUS_LAB5
+    if (a->shmem_key != b->shmem_key)
+        return false;
+#endif
+    // disk VMAs must map consecutive sectors
+    if (a->type == VMA_DISK && b->secno != a->secno + a->len / SECTSIZE)
+        return false;
 
-    // fill it in
-    v->type = (bin == NULL) ? VMA_ANON : VMA_BINARY;
-    v->va   = va;
-    v->len  = len;
-    v->perm = perm | PTE_U;
-    v->ph   = ph;
-    v->bin  = bin;
+    // binary VMAs of different segments are read back from
+    // different places of the image
+    return a->type == b->type && a->perm == b->perm && a->advice == b->advice
+        && a->ph == b->ph && a->bin == b->bin;
+}
+#endif
 
-    // perform one round of VMA merging
+/*
+ * Joins VMA 'v' of 'e' with the VMAs ending right at its start and starting
+ * right at its end, where possible. Returns the VMA now covering 'v'.
+ */
+static struct vma *vma_merge(struct env *e, struct vma *v)
+{
 #ifdef VMA_MERGE
-    vma_merge(e);
+    struct vma *prev = v->va ? vma_lookup(e, v->va - 1) : NULL;
+    struct vma *next = vma_lookup(e, v->va + v->len);
+
+    if (next && vma_mergeable(v, next)) {
+        v->len += next->len;
+        e->env_vmas = vma_tree_erase(e->env_vmas, next);
+        kmem_cache_free(vma_cache, next);
+        vma_tree_fixup(e->env_vmas, v);
+    }
+    if (prev && vma_mergeable(prev, v)) {
+        prev->len += v->len;
+        e->env_vmas = vma_tree_erase(e->env_vmas, v);
+        kmem_cache_free(vma_cache, v);
+        vma_tree_fixup(e->env_vmas, prev);
+        v = prev;
+    }
 #endif
+    return v;
+}
 
+/*
+ * Splits VMA 'v' of 'e' at 'va', which must lie inside it. 'v' keeps the part
+ * below 'va'. Returns the new VMA for the rest, or NULL if out of memory.
+ */
+static struct vma *vma_split(struct env *e, struct vma *v, void *va)
+{
+    assert(v->va < va && va < v->va + v->len);
+
+    struct vma *right = kmem_cache_alloc(vma_cache, 0);
+    if (!right)
+        return NULL;
+
+    // same backing; binary VMAs compute offsets from the program header
+    *right = *v;
+    right->va = va;
+    right->len = v->va + v->len - va;
+    if (v->type == VMA_DISK)
+        right->secno += (va - v->va) / SECTSIZE;
+
+    v->len = va - v->va;
+    vma_tree_fixup(e->env_vmas, v);
+    e->env_vmas = vma_tree_insert(e->env_vmas, right);
+    return right;
+}
+
+/*
+ * Splits VMA 'v' of 'e' where needed so that the returned VMA is the part of
+ * 'v' inside [start, end). Returns NULL if out of memory.
+ */
+static struct vma *vma_clip(struct env *e, struct vma *v, void *start, void *end)
+{
+    if (v->va < start && !(v = vma_split(e, v, start)))
+        return NULL;
+    if (v->va + v->len > end && !vma_split(e, v, end))
+        return NULL;
     return v;
 }
 
 /*
- * Remove a VMA block from the chain.
- * If destructive is set, also removes the physical memory. If its cleared, it
- * doesn't remove the physical memory. This is used by VMA merging and should
- * never be used for another purpose.
+ * Allocates a VMA block of 'type' that is not in any tree yet. Of 'perm',
+ * which may come from user space, only PTE_W is kept; the block is always
+ * user-accessible.
+ * Returns NULL if out of memory.
  */
-void vma_rmv(struct env *e, void *va, size_t len, int destructive) {
-    int slot = vma_find_slot_by_va(e, va);
+static struct vma *vma_alloc(int type, void *va, size_t len, int perm)
+{
+    assert(len > 0);
 
-    void *rmv_start = va, *rmv_end = va + len;
+    struct vma *v = kmem_cache_alloc(vma_cache, ALLOC_ZERO);
+    if (!v) return NULL;
 
-    // cannot find
-    if (slot == -1) {
-        cprintf("vma_rmv called on invalid slot??\n");
-        return;
-    }
+    v->type   = type;
+    v->va     = va;
+    v->len    = len;
+    v->perm   = (perm & PTE_W) | PTE_U;
+    v->advice = MADV_NORMAL;
+    return v;
+}
+
+/*
+ * Inserts a new VMA block into the tree, merging it with its immediate
+ * neighbours where possible.
+ * Returns the VMA now covering the block, or NULL on failure.
+ */
+struct vma *vma_new(struct env *e, void *va, size_t len, int perm,
+             struct elf_proghdr *ph, uint8_t *bin)
+{
+    struct vma *v = vma_alloc((bin == NULL) ? VMA_ANON : VMA_BINARY,
+                              va, len, perm);
+    if (!v) return NULL;
 
-    if (va + len > e->env_vmas[slot].va + e->env_vmas[slot].len)
-        panic("vma_rmv len too large");
+    v->ph  = ph;
+    v->bin = bin;
 
-    if (e->env_vmas[slot].va == va) {
-        // va+len collide (destroy)
-        if (e->env_vmas[slot].len == len) {
-            e->env_vmas[slot].type = VMA_UNUSED;
-        }
-        // va collides, but len doesn't (move left boundery =>)
-        else {
-            e->env_vmas[slot].va += len;
-            e->env_vmas[slot].len -= len;
-        }
+    e->env_vmas = vma_tree_insert(e->env_vmas, v);
+    return vma_merge(e, v);
+}
+
+#ifdef BONUS_LAB5
+/*
+ * Inserts a new block of shared memory under 'key'. The key is set before
+ * merging, so the block is only joined with neighbours of the same key and
+ * never takes in private memory next to it.
+ * Returns the VMA now covering the block, or NULL on failure.
+ */
+struct vma *vma_new_shmem(struct env *e, void *va, size_t len, int perm,
+                          int key)
+{
+    struct vma *v = vma_alloc(VMA_ANON, va, len, perm);
+    if (!v) return NULL;
+
+    v->shmem_key = key;
+
+    e->env_vmas = vma_tree_insert(e->env_vmas, v);
+    return vma_merge(e, v);
+}
+#endif
+
+/*
+ * Returns whether the disk for VMA_DISK regions is attached.
+ */
+static bool vma_disk_present(void)
+{
+    static int present = -1;
+
+    if (present < 0)
+        present = ide_probe_disk(VMA_DISKNO);
+    return present;
+}
+
+/*
+ * Inserts a new VMA block mapping the sectors of disk VMA_DISKNO from 'secno'
+ * on at the page-aligned address 'va'. Like vma_new, it is merged with its
+ * neighbours where possible.
+ * Returns the VMA now covering the block, or NULL on failure or if the disk is
+ * not attached.
+ */
+struct vma *vma_new_disk(struct env *e, void *va, size_t len, int perm,
+                         uint32_t secno)
+{
+    assert((uintptr_t) va % PGSIZE == 0);
+
+    if (!vma_disk_present())
+        return NULL;
+
+    struct vma *v = vma_alloc(VMA_DISK, va, ROUNDUP(len, PGSIZE), perm);
+    if (!v) return NULL;
+
+    v->secno = secno;
+
+    e->env_vmas = vma_tree_insert(e->env_vmas, v);
+    return vma_merge(e, v);
+}
+
+/*
+ * Writes the 'n' pages of disk region 'v' at the addresses in 'va' back to
+ * the disk. Their dirty bits were cleared; the TLBs are flushed before the
+ * pages are read, so writes from now on mark them dirty again.
+ * Returns 0 on success, -E_IO if the disk failed.
+ */
+static int vma_writeback(struct env *e, struct vma *v, uintptr_t *va, size_t n)
+{
+    int r = 0;
+
+    tlb_shootdown(e->env_pgdir, va, n);
+    for (size_t i = 0; i < n; i++) {
+        struct page_info *pp = page_lookup(e->env_pgdir, (void *) va[i], NULL);
+        char *kva = kmap(pp);
+
+        if (ide_write(VMA_DISKNO, vma_disk_sector(v, va[i]), kva,
+                      SECTPERPAGE) < 0)
+            r = -E_IO;
+        kunmap(kva);
     }
-    else {
-        // end collides, but va doesn't (move right boundary <=)
-        if (va + len == e->env_vmas[slot].va + e->env_vmas[slot].len) {
-            e->env_vmas[slot].len = va - e->env_vmas[slot].va;
-        }
-        // no collision, the freed region is in middle
-        else {
-            size_t left_len  = va - e->env_vmas[slot].va;
-            void *right_vma  = (void *) ((size_t) va + len);
-            size_t right_len = e->env_vmas[slot].len - left_len - len;
-
-            // (left) shorten existing vma
-            e->env_vmas[slot].len = left_len;
-
-            // (right) spawn new vma
-            vma_new(e, right_vma, right_len,
-                    e->env_vmas[slot].perm,
-                    e->env_vmas[slot].ph, // can you even split binaries?
-                    e->env_vmas[slot].bin);
+    return r;
+}
+
+/*
+ * Writes the dirty pages of the disk regions in [va, va + len) of 'e' back to
+ * the disk. Other regions are left alone.
+ * Returns 0 on success, -E_IO if the disk failed for some page.
+ */
+int vma_sync(struct env *e, void *va, size_t len)
+{
+    void *end = va + len;
+    uintptr_t batch[TLB_FLUSH_MAX];
+    int r = 0;
+
+    for (struct vma *v = vma_find_from(e, va); v && v->va < end;
+         v = vma_next(e, v)) {
+        struct pt_walk w;
+        size_t n = 0;
+
+        if (v->type != VMA_DISK)
+            continue;
+
+        pt_walk_init(&w, e->env_pgdir, MAX(va, v->va), MIN(end, v->va + v->len));
+        while (pt_walk_next(&w)) {
+            if ((*w.pte & (PTE_P | PTE_D | PTE_PS)) != (PTE_P | PTE_D))
+                continue;
+
+            *w.pte &= ~PTE_D;
+            batch[n++] = w.va;
+            if (n == TLB_FLUSH_MAX) {
+                if (vma_writeback(e, v, batch, n) < 0)
+                    r = -E_IO;
+                n = 0;
+            }
         }
+        if (n && vma_writeback(e, v, batch, n) < 0)
+            r = -E_IO;
     }
+    return r;
+}
+
+/*
+ * Remove a VMA block from the tree.
+ * If destructive is set, also removes the physical memory. If its cleared, the
+ * pages stay mapped.
+ * Returns 0 on success, -E_INVAL if the range is not inside one VMA, or
+ * -E_NO_MEM if a VMA, huge page or shared page table could not be split. On
+ * failure the VMA stays in the tree, though part of its pages may be gone.
+ */
+int vma_rmv(struct env *e, void *va, size_t len, int destructive) {
+    struct vma *v = vma_lookup(e, va);
+
+    // cannot find
+    if (!v || len == 0 || va + len > v->va + v->len)
+        return -E_INVAL;
+
+    // cut out the removed part before anything of it is dropped
+    if (!(v = vma_clip(e, v, va, va + len)))
+        return -E_NO_MEM;
 
-    // remove physpages
-    if (destructive)
-        for (void *i = rmv_start; i < rmv_end; i++)
-            page_remove(e->env_pgdir, i);
+    // disk regions keep what was written to them
+    if (destructive && vma_sync(e, va, len) < 0)
+        cprintf("vma_rmv: could not write back disk pages\n");
+
+    // remove physpages in one sweep; huge pages that stick out of the range
+    // are split, so only their part inside the range is released
+    if (destructive && unmap_range(e->env_pgdir, va, len) < 0)
+        return -E_NO_MEM;
+
+    e->env_vmas = vma_tree_erase(e->env_vmas, v);
+    kmem_cache_free(vma_cache, v);
+    return 0;
 }
 
 /*
- * Calling this function will perform one round of VMA merging. Note that, due
- * to the merge, new merging oportunities might arise.
+ * Returns whether [va, end) is a non-empty, page-aligned user range covered
+ * by VMAs of 'e' without holes.
  */
-void vma_merge(struct env *e) {
+static bool vma_range_ok(struct env *e, void *va, void *end)
+{
+    if ((uintptr_t) va % PGSIZE || end <= va || end > (void *) UTOP)
+        return false;
 
-    for (size_t outer = 0; outer < VMA_LENGTH; outer++) {
-        struct vma *o = &e->env_vmas[outer];
-        if (o->type == VMA_UNUSED) continue;
+    while (va < end) {
+        struct vma *v = vma_lookup(e, va);
+        if (!v)
+            return false;
+        va = v->va + v->len;
+    }
+    return true;
+}
 
-        void *o_left = o->va;
-        void *o_right = o->va + o->len;
+/*
+ * Applies access hint 'advice' to the page-aligned range [va, va + len), which
+ * must be covered by VMAs of 'e':
+ *   MADV_NORMAL      default fault-around on anonymous faults
+ *   MADV_RANDOM      map only the faulting page
+ *   MADV_SEQUENTIAL  map VMA_READAHEAD pages from the faulting page on
+ *   MADV_WILLNEED    map the anonymous pages of the range now, as far as
+ *                    memory is free
+ *   MADV_DONTNEED    drop the pages of the range but keep the VMAs; anonymous
+ *                    pages read back as zero, binary pages from the image,
+ *                    disk pages from the disk after writing them back
+ * The first three are remembered per VMA, splitting VMAs at the range bounds.
+ * Returns 0 on success, -E_INVAL for a bad range or advice, -E_NO_MEM if a VMA
+ * or a huge page could not be split, -E_IO if disk pages could not be written
+ * back.
+ */
+int vma_advise(struct env *e, void *va, size_t len, int advice)
+{
+    void *end = va + ROUNDUP(len, PGSIZE);
 
-        for (size_t inner = 0; inner < VMA_LENGTH; inner++) {
-            struct vma *i = &e->env_vmas[inner];
-            if (i->type == VMA_UNUSED || inner == outer) continue;
-            void *i_left = i->va;
-            void *i_right = i->va + i->len;
+    if (!vma_range_ok(e, va, end))
+        return -E_INVAL;
 
-            if (o->type == i->type && o->perm == i->perm) {
-                if (i_left == o_right) {
-                    int len = i->len;
-                    vma_rmv(e, i->va, i->len, VMA_RETAIN_PHYS);
-                    o->len += len;
-                    break;
-                }
-                else if (i_right == o_left) {
-                    int len = o->len;
-                    vma_rmv(e, o->va, o->len, VMA_RETAIN_PHYS);
-                    i->len += len;
+    switch (advice) {
+        case MADV_NORMAL:
+        case MADV_RANDOM:
+        case MADV_SEQUENTIAL:
+            for (void *a = va; a < end; ) {
+                struct vma *v = vma_clip(e, vma_lookup(e, a), a, end);
+                if (!v)
+                    return -E_NO_MEM;
+                v->advice = advice;
+                a = v->va + v->len;
+                vma_merge(e, v);
+            }
+            return 0;
+
+        case MADV_WILLNEED:
+            for (struct vma *v = vma_lookup(e, va); v && v->va < end;
+                 v = vma_next(e, v)) {
+                if (v->type == VMA_ANON
+                    && vma_populate(e, v, va, end - va, ALLOC_NORECLAIM) < 0)
                     break;
-                }
             }
-        }
+            return 0;
+
+        case MADV_DONTNEED:
+            // disk regions read back what was written to them
+            if (vma_sync(e, va, end - va) < 0)
+                return -E_IO;
+            return unmap_range(e->env_pgdir, va, end - va);
+
+        default:
+            return -E_INVAL;
     }
 }
 
 /*
- * Helper function. Finds first free slot in VMA chain and returns index of that
- * slot. Returns -1 if no slots available.
+ * Returns the first VMA that ends above va, i.e. the VMA containing va or
+ * else the next one after it. Returns NULL if there is none.
  */
-static int vma_find_free_slot(struct env *e) {
-    for (size_t i = 0; i < VMA_LENGTH; i++)
-        if (e->env_vmas[i].type == VMA_UNUSED)
-            return i;
-    return -1;
+struct vma *vma_find_from(struct env *e, void *va) {
+    struct vma *found = NULL;
+
+    for (struct vma *n = e->env_vmas; n; ) {
+        if (va < n->va + n->len) {
+            found = n;
+            n = n->left;
+        } else {
+            n = n->right;
+        }
+    }
+    return found;
 }
 
-/**
- * Returns index to the slot in VMA that contains va
- * Returns VMA_NOSLOT if va not in VMA
- * addresses in VMA are assumed to not overlap
+/*
+ * Returns the VMA that contains va, or NULL if va is not in any VMA.
  */
-static int vma_find_slot_by_va(struct env *e, void *va) {
-    for (int i = 0; i < VMA_LENGTH; i++) {
-        if (e->env_vmas[i].type != VMA_UNUSED
-            && e->env_vmas[i].va <= va
-            && e->env_vmas[i].va + e->env_vmas[i].len > va)
-            return i;
-    }
-    return -1;
+struct vma *vma_lookup(struct env *e, void *va) {
+    struct vma *v = vma_find_from(e, va);
+    return (v && v->va <= va) ? v : NULL;
 }
 
 /*
  * Helper function. Returns the first free virtual memory address that could fit
  * the request. This function will reuse low memory addresses as they are freed.
+ * The hole must be at least a page larger than the request.
  */
 void *vma_find_mem(struct env *e, size_t len) {
-    void *target = (void *) UTEXT;
-    len = ROUNDUP(len, PGSIZE);
-    int consec = 0;
-
-    // search page by page...
-    for (void *current = (void *) UTEXT; current < (void *) USTACKTOP; current += PGSIZE) {
-        // ... check if this page occupied
-        for (size_t i = 0; i < VMA_LENGTH; i++) {
-            if (e->env_vmas[i].type != VMA_UNUSED) {
-                struct vma *v = &e->env_vmas[i];
-                if (v->va <= current && v->va + v->len > current) {
-                    // page occupied
-                    target = current + PGSIZE;
-                    consec = 0;
-                }
-            }
-        }
+    struct vma *root = e->env_vmas;
+    uintptr_t va;
 
-        // all vma's checked, this page is free
-        consec += PGSIZE;
+    len = ROUNDUP(len, PGSIZE);
+    if (!root)
+        return (void *) vma_gap_fit(0, USTACKTOP, len);
 
-        if (consec > len)
-            return target;
-    }
+    // below the first VMA, between two VMAs, or above the last one
+    if ((va = vma_gap_fit(0, root->lo, len))
+        || (va = vma_tree_find_gap(root, len))
+        || (va = vma_gap_fit(root->hi, USTACKTOP, len)))
+        return (void *) va;
 
     // no space found
     return NULL;
 }
 
 /*
- * Searches for a VA in the VMA chain. If found, attempts to page in.
- * Returns 0 on success, -1 on failure.
+ * Changes the access permissions of the page-aligned range [va, va + len),
+ * which must be covered by VMAs of 'e', to 'perm': VMA_PERM_R for read only,
+ * VMA_PERM_R|VMA_PERM_W or VMA_PERM_W for read/write and 0 for no access. VMAs
+ * are split at the range bounds and merged with their neighbours again.
+ * The PTEs of the range are rewritten in one pass with a single TLB flush.
+ * Write access is left to the page fault handler, which grants it page by
+ * page, so pages shared copy-on-write are not written through.
+ * Returns 0 on success, -E_INVAL for a bad range or permission or a range with
+ * shared memory, -E_NO_MEM if a VMA, a huge page or a shared page table could
+ * not be split. On -E_NO_MEM, the range keeps its old permissions where they
+ * are more restrictive than 'perm'.
  */
-int vma_seek(struct env *e, void *va) {
-    for (size_t i = 0; i < VMA_LENGTH; i++) {
-        if (e->env_vmas[i].type != VMA_UNUSED &&
-            e->env_vmas[i].va <= va &&
-            e->env_vmas[i].va + e->env_vmas[i].len > va)
-        {
-            return i;
+int vma_protect(struct env *e, void *va, size_t len, int perm)
+{
+    void *end = va + ROUNDUP(len, PGSIZE);
+    struct vma *v;
+    int r;
+
+    if (perm & ~(VMA_PERM_R | VMA_PERM_W) || !vma_range_ok(e, va, end))
+        return -E_INVAL;
+
+#ifdef BONUS_LAB5
+    // pages of shared memory must stay shared when written
+    for (v = vma_lookup(e, va); v && v->va < end; v = vma_next(e, v))
+        if (v->shmem_key)
+            return -E_INVAL;
+#endif
+
+    if (perm & VMA_PERM_W)
+        perm = PTE_U | PTE_W;
+    else if (perm & VMA_PERM_R)
+        perm = PTE_U;
+
+    // split at the range bounds first; nothing is protected differently if
+    // that runs out of memory
+    for (void *a = va; a < end; a = v->va + v->len)
+        if (!(v = vma_clip(e, vma_lookup(e, a), a, end)))
+            return -E_NO_MEM;
+
+    // a VMA gains rights before its PTEs and loses them only after, so a
+    // failing protect_range never leaves a PTE granting more than its VMA
+    for (v = vma_lookup(e, va); v && v->va < end; v = vma_next(e, v))
+        if ((v->perm | perm) == perm)
+            v->perm = perm;
+
+    if ((r = protect_range(e->env_pgdir, va, end - va, perm & ~PTE_W)) < 0)
+        return r;
+
+    for (void *a = va; a < end; ) {
+        v = vma_lookup(e, a);
+        v->perm = perm;
+        a = v->va + v->len;
+        vma_merge(e, v);
+    }
+    return 0;
+}
+
+/*
+ * Maps zeroed pages into the unmapped part of [va, va + len) within anonymous
+ * VMA 'v' of 'e'. Whole 4MB regions with no page table yet are backed by a
+ * huge page if one is free. 'alloc_flags' are passed on to page_alloc.
+ * Returns 0 on success, -1 if memory ran out; the pages mapped so far stay.
+ */
+int vma_populate(struct env *e, struct vma *v, void *va, size_t len,
+                 int alloc_flags)
+{
+    uintptr_t start = MAX(ROUNDDOWN((uintptr_t) va, PGSIZE), vma_start(v));
+    uintptr_t end = MIN(ROUNDUP((uintptr_t) va + len, PGSIZE), vma_end(v));
+    int perm = v->perm;
+    struct page_info *pp;
+
+    assert(v->type == VMA_ANON);
+
+    for (uintptr_t a = start; a < end; a += PGSIZE) {
+        pde_t pde = e->env_pgdir[PDX(a)];
+
+        // already backed by a huge page
+        if (pde & PTE_PS) {
+            a = ROUNDDOWN(a, PTSIZE) + PTSIZE - PGSIZE;
+            continue;
+        }
+
+        if (!(pde & PTE_P) && a % PTSIZE == 0 && end - a >= PTSIZE) {
+            pp = page_alloc(ALLOC_HUGE | ALLOC_ZERO | ALLOC_HIGHMEM | alloc_flags);
+            if (pp && page_insert(e->env_pgdir, pp, (void *) a,
+                                  perm | PTE_PS) == 0) {
+                a += PTSIZE - PGSIZE;
+                continue;
+            }
+            if (pp)
+                page_free(pp);
+        }
+
+        // mapped or swapped out
+        pte_t *pte = pgdir_walk(e->env_pgdir, (void *) a, 0);
+        if (pte && *pte)
+            continue;
+
+        pp = page_alloc(ALLOC_ZERO | ALLOC_HIGHMEM | alloc_flags);
+        if (!pp)
+            return -1;
+        if (page_insert(e->env_pgdir, pp, (void *) a, perm) < 0) {
+            page_free(pp);
+            return -1;
         }
     }
-    return -1;
+    return 0;
 }
 
 /*
- * Debug function. Prints the VMA chain for an environment.
- * Note that empty entries are not printed.
+ * Debug function. Prints the VMA tree for an environment in address order.
  */
 void vma_print(struct env *e) {
-    size_t count_used = 0, count_vacant = 0;
+    size_t count_used = 0;
     cprintf(">> ------------------------------------------------\n");
-    for (size_t i = 0; i < VMA_LENGTH; i++) {
-        struct vma v = e->env_vmas[i];
-        if (v.type == VMA_UNUSED) {
-            count_vacant += 1;
+    for (struct vma *v = vma_first(e); v; v = vma_next(e, v)) {
+        cprintf(">> %x [%03u]: ", e->env_id, count_used);
+        count_used += 1;
+        switch (v->type) {
+            case VMA_ANON:   cprintf("ANON "); break;
+            case VMA_BINARY: cprintf("BIN  "); break;
+            case VMA_DISK:   cprintf("DISK "); break;
+            default:         cprintf("???? "); break;
         }
-        else {
-            count_used += 1;
-            cprintf(">> %x [%03u]: ", e->env_id, i);
-            switch (v.type) {
-                case VMA_ANON:   cprintf("ANON "); break;
-                case VMA_BINARY: cprintf("BIN  "); break;
-                default:         cprintf("???? "); break;
-            }
-            cprintf("| Perm: ");
-            switch (v.perm) {
-                case 1:  cprintf("  E x1 "); break;
-                case 2:  cprintf(" W  x2 "); break;
-                case 3:  cprintf(" WE x3 "); break;
-                case 4:  cprintf("R   x4 "); break;
-                case 5:  cprintf("R E x5 "); break;
-                case 6:  cprintf("RW  x6 "); break;
-                case 7:  cprintf("RWE x7 "); break;
-                default: cprintf("?????? "); break;
-            }
-            cprintf("| %x - %x (%x)\n", v.va, v.va + v.len, v.len);
+        cprintf("| Perm: ");
+        switch (v->perm) {
+            case 1:  cprintf("  E x1 "); break;
+            case 2:  cprintf(" W  x2 "); break;
+            case 3:  cprintf(" WE x3 "); break;
+            case 4:  cprintf("R   x4 "); break;
+            case 5:  cprintf("R E x5 "); break;
+            case 6:  cprintf("RW  x6 "); break;
+            case 7:  cprintf("RWE x7 "); break;
+            default: cprintf("?????? "); break;
         }
+        cprintf("| %x - %x (%x)\n", v->va, v->va + v->len, v->len);
     }
-    cprintf(">> Summary: %u used, %u vacant.\n", count_used, count_vacant);
+    cprintf(">> Summary: %u used, tree height %d.\n", count_used,
+            e->env_vmas ? e->env_vmas->height : 0);
     cprintf(">> ------------------------------------------------\n");
 }
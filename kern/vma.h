@@ -5,11 +5,33 @@
 #include <inc/elf.h>
 #include <kern/pmap.h>
 #include <kern/env.h>
+#include <kern/ide.h>
 
-#define VMA_LENGTH 128
 #define VMA_DEBUG 1
 #define MAP_POPULATE 1
 
+/* Window of pages, aligned to its size, that an anonymous fault maps at once.
+ * Must be a power of two; 1 disables fault-around. */
+#define VMA_FAULT_AROUND 16
+/* Pages mapped from the faulting page on in a VMA advised MADV_SEQUENTIAL */
+#define VMA_READAHEAD 64
+
+/* Disk that VMA_DISK regions map, and its size in sectors; kern/Makefrag
+ * sizes data.img to match */
+#define VMA_DISKNO      2
+#define VMA_DISK_SECTS  32768   /* 16MB */
+
+/* Permissions for sys_vma_protect, as PERM_* in inc/lib.h */
+#define VMA_PERM_R      0x1
+#define VMA_PERM_W      0x2
+
+/* Advice for sys_vma_advise, as in inc/lib.h */
+#define MADV_NORMAL     0
+#define MADV_RANDOM     1
+#define MADV_SEQUENTIAL 2
+#define MADV_WILLNEED   3
+#define MADV_DONTNEED   4
+
 #define VMA_MERGE // disable to not merge
 #define BONUS_LAB5 // disable to disable shmem
 #define VMA_RETAIN_PHYS 0
@@ -19,6 +41,7 @@ enum {
     VMA_UNUSED = 0,
     VMA_ANON,
     VMA_BINARY,
+    VMA_DISK,
 };
 
 struct vma {
@@ -28,23 +51,62 @@ struct vma {
     int perm;
     struct elf_proghdr *ph;
     uint8_t *bin;
+    uint32_t secno;     // VMA_DISK: first sector, mapped at va
+    int advice;
 #ifdef BONUS_LAB5
     int shmem_key;
 #endif
+
+    // AVL tree linkage, ordered by va
+    struct vma *left;
+    struct vma *right;
+    int height;
+
+    // page-rounded bounds of the subtree and the largest hole between two
+    // of its VMAs, used by vma_find_mem
+    uintptr_t lo;
+    uintptr_t hi;
+    size_t max_gap;
 };
 
 // interface
 void vma_init(struct env *e);
-void vma_rmv(struct env *e, void *va, size_t len, int destrucive);
+void vma_free(struct env *e);
+int vma_rmv(struct env *e, void *va, size_t len, int destrucive);
 struct vma *vma_new(struct env *e, void *va, size_t len, int perm,
              struct elf_proghdr *ph, uint8_t *bin);
-int vma_seek(struct env *e, void *va);
+#ifdef BONUS_LAB5
+struct vma *vma_new_shmem(struct env *e, void *va, size_t len, int perm,
+                          int key);
+#endif
+struct vma *vma_new_disk(struct env *e, void *va, size_t len, int perm,
+                         uint32_t secno);
+int vma_sync(struct env *e, void *va, size_t len);
+int vma_clone(struct env *dst, struct env *src);
+int vma_advise(struct env *e, void *va, size_t len, int advice);
+int vma_protect(struct env *e, void *va, size_t len, int perm);
+struct vma *vma_find_from(struct env *e, void *va);
+struct vma *vma_lookup(struct env *e, void *va);
 void vma_print(struct env *e);
 void *vma_find_mem(struct env *e, size_t len);
+int vma_populate(struct env *e, struct vma *v, void *va, size_t len,
+                 int alloc_flags);
+
+/* First disk sector of the page holding 'va' in VMA_DISK region 'v' */
+static inline uint32_t vma_disk_sector(struct vma *v, uintptr_t va)
+{
+    return v->secno + (ROUNDDOWN(va, PGSIZE) - (uintptr_t) v->va) / SECTSIZE;
+}
+
+/* In-order iteration over the VMAs of an environment. */
+static inline struct vma *vma_first(struct env *e)
+{
+    return vma_find_from(e, 0);
+}
 
-// private helpers
-static int vma_find_free_slot(struct env *e);
-static int vma_find_slot_by_va(struct env *e, void *va);
-void vma_merge(struct env *e);
+static inline struct vma *vma_next(struct env *e, struct vma *v)
+{
+    return vma_find_from(e, v->va + v->len);
+}
 
 #endif // JOS_KERN_VMA_H
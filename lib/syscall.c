@@ -70,6 +70,26 @@ int sys_vma_destroy(void *va, size_t size)
     return syscall(SYS_vma_destroy, 0, (uint32_t) va, size, 0, 0 ,0);
 }
 
+int sys_vma_advise(void *va, size_t size, int advice)
+{
+    return syscall(SYS_vma_advise, 0, (uint32_t) va, size, advice, 0, 0);
+}
+
+int sys_vma_protect(void *va, size_t size, int perm)
+{
+    return syscall(SYS_vma_protect, 0, (uint32_t) va, size, perm, 0, 0);
+}
+
+void *sys_disk_map(uint32_t secno, size_t size, int perm)
+{
+    return (void *)syscall(SYS_disk_map, 0, secno, size, perm, 0, 0);
+}
+
+int sys_disk_sync(void *va, size_t size)
+{
+    return syscall(SYS_disk_sync, 0, (uint32_t) va, size, 0, 0, 0);
+}
+
 void sys_yield(void)
 {
     syscall(SYS_yield, 0, 0, 0, 0, 0, 0);
@@ -0,0 +1,34 @@
+#include <inc/assert.h>
+#include <inc/lib.h>
+
+#define TILE_SIZE	(4096)
+#define MAP_SPACE	(4 * TILE_SIZE)
+#define SECTOR		(8)
+#define TILE(I)		(I * TILE_SIZE)
+
+void umain(int argc, char **argv)
+{
+    uint32_t *va = sys_disk_map(SECTOR, MAP_SPACE, PERM_W);
+
+    assert(va != (uint32_t *) -1);
+
+    /* write a pattern and push it to the disk */
+    va[0] = 0x01010101;
+    *(uint32_t *) ((char *) va + TILE(3)) = 0x03030303;
+    assert(0 == sys_disk_sync(va, MAP_SPACE));
+
+    /* unmapping writes back the rest */
+    *(uint32_t *) ((char *) va + TILE(2)) = 0x02020202;
+    assert(0 == sys_vma_destroy(va, MAP_SPACE));
+
+    /* a mapping starting a page later sees the same data */
+    va = sys_disk_map(SECTOR + TILE_SIZE / 512, TILE(3), PERM_R);
+    assert(va != (uint32_t *) -1);
+    assert(*(uint32_t *) ((char *) va + TILE(1)) == 0x02020202);
+    assert(*(uint32_t *) ((char *) va + TILE(2)) == 0x03030303);
+
+    /* sectors past the end of the disk are rejected */
+    assert(sys_disk_map(32768 - 1, TILE_SIZE, PERM_R) == (void *) -1);
+
+    cprintf("diskmap: OK\n");
+}
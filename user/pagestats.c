@@ -0,0 +1,22 @@
+/* Print the physical page allocator statistics the kernel exports at UPSTATS. */
+#include <inc/lib.h>
+
+void umain(int argc, char **argv)
+{
+    int i;
+
+    cprintf("generation %u\n", pstats.generation);
+    cprintf("free %u of %u pages, %u high\n", pstats.nfree, pstats.npages,
+            pstats.nfree_high);
+    for (i = 0; i <= MAX_ORDER; i++)
+        cprintf("order %2d: %6u blocks, frag %4u\n", i, pstats.nr_blocks[i],
+                pstats.frag_index[i]);
+    cprintf("allocs %u, frees %u, failures %u, huge failures %u\n",
+            pstats.allocs, pstats.frees, pstats.failures,
+            pstats.flag_failures[PSTAT_HUGE]);
+
+    /* the page is read-only */
+    cprintf("writing to pstats\n");
+    *(volatile uint32_t *) &pstats.generation = 0;
+    panic("pstats is writable!");
+}
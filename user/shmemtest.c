@@ -19,8 +19,13 @@ void umain(int argc, char **argv)
         cprintf("[y] Done.\n");
     }
     else {
-        char *mydata = sys_shmem_alloc(500, 0x42);
+        // private memory right below the shared region must not join it
+        char *priv = sys_vma_create(PGSIZE, PERM_W, 0);
+        char *mydata = sys_shmem_alloc(PGSIZE, 0x42);
         cprintf("[x] Creating shared memory at %p..\n", mydata);
+        assert(mydata == priv + PGSIZE);
+        assert(sys_vma_protect(priv, PGSIZE, PERM_R) == 0);
+        assert(sys_vma_protect(mydata, PGSIZE, PERM_R) < 0);
         mydata[50] = 0x77;
         mydata[111] = 0x57;
         sys_wait(id); // wait for remote to utilize the data
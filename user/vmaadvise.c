@@ -0,0 +1,34 @@
+#include <inc/assert.h>
+#include <inc/lib.h>
+
+#define TILE_SIZE	(4096)
+#define BUF_SPACE	(32 * TILE_SIZE)
+#define TILE(I)		(I * TILE_SIZE)
+
+void umain(int argc, char **argv)
+{
+    char *va = sys_vma_create(BUF_SPACE, PERM_W, 0);
+    int i;
+
+    assert(va != (char *) -1);
+
+    /* sequential fill, then recycle the buffer without unmapping it */
+    assert(0 == sys_vma_advise(va, BUF_SPACE, MADV_SEQUENTIAL));
+    for (i = 0; i < BUF_SPACE; i += TILE_SIZE)
+        va[i] = 0x42;
+    assert(0 == sys_vma_advise(va, BUF_SPACE, MADV_DONTNEED));
+    for (i = 0; i < BUF_SPACE; i += TILE_SIZE)
+        assert(va[i] == 0);
+
+    /* advice on part of the buffer, and prefaulting */
+    assert(0 == sys_vma_advise(va + TILE(4), TILE(8), MADV_RANDOM));
+    assert(0 == sys_vma_advise(va + TILE(16), TILE(4), MADV_WILLNEED));
+    va[TILE(17)] = 0x17;
+
+    /* bad ranges and advice are rejected */
+    assert(sys_vma_advise(va + 1, TILE_SIZE, MADV_NORMAL) < 0);
+    assert(sys_vma_advise(va, BUF_SPACE + TILE_SIZE, MADV_NORMAL) < 0);
+    assert(sys_vma_advise(va, BUF_SPACE, 42) < 0);
+
+    cprintf("vmaadvise: OK\n");
+}
@@ -0,0 +1,33 @@
+#include <inc/assert.h>
+#include <inc/lib.h>
+
+#define TILE_SIZE	(4096)
+#define BUF_SPACE	(8 * TILE_SIZE)
+#define TILE(I)		(I * TILE_SIZE)
+
+void umain(int argc, char **argv)
+{
+    uint32_t *va = sys_vma_create(BUF_SPACE, PERM_W, MAP_POPULATE);
+
+    assert(va != (uint32_t *) -1);
+    va[0] = 0x7777;
+
+    /* contents survive a round trip through read-only */
+    assert(0 == sys_vma_protect(va, BUF_SPACE, PERM_R));
+    assert(va[0] == 0x7777);
+    assert(0 == sys_vma_protect(va, BUF_SPACE, PERM_R | PERM_W));
+    va[0] = 0x8888;
+
+    /* bad ranges and permissions are rejected */
+    assert(sys_vma_protect((char *) va + 1, TILE_SIZE, PERM_R) < 0);
+    assert(sys_vma_protect(va, BUF_SPACE, 0x10) < 0);
+
+    /* guard page in the middle */
+    assert(0 == sys_vma_protect((char *) va + TILE(4), TILE_SIZE, 0));
+    *(volatile uint32_t *) ((char *) va + TILE(3)) = 0x03030303;
+    *(volatile uint32_t *) ((char *) va + TILE(5)) = 0x05050505;
+
+    cprintf("touching the guard page\n");
+    *(volatile uint32_t *) ((char *) va + TILE(4)) = 0x0BADB10C;
+    panic("SHOULD HAVE TRAPPED!!!");
+}